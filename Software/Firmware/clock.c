@@ -0,0 +1,515 @@
+/**
+ * @file
+ * Interner Taktgeber und Clock-Folger auf Basis von Timer1
+ *
+ * Timer1 läuft frei durch (siehe timer.c), der Takt wird über Output-Compare A
+ * erzeugt: bei jedem Compare-Match wird OCR1A um den Abstand zweier Ticks
+ * weitergeschoben. Ein Tick ist 1/4 Midi-Clock (96 ppqn). Der Abstand wird
+ * mit 8 Nachkomma-Bits geführt, die aufgelaufenen Nachkomma-Anteile werden bei
+ * jedem Schritt übertragen. So driftet der Takt auch über lange Zeit nicht weg
+ * (Auflösung 2µs/256 ≈ 8ns), obwohl der Timer selbst nur in 2µs-Schritten zählt.
+ *
+ * Im internen Modus ergibt sich der Abstand aus dem eingestellten Tempo, bei
+ * jedem vierten Tick wird eine Midi-Clock gesendet.
+ *
+ * Bei externer Clock arbeitet der Taktgeber als Software-PLL: die Zeitstempel
+ * der empfangenen Midi-Clocks bestimmen über einen Festkomma-Filter die
+ * Periode, die Phasenabweichung zwischen empfangener Clock und erzeugtem Tick
+ * wird zu einem Viertel pro Clock ausgeglichen. Die Ticks laufen damit
+ * gleichmäßig durch, auch wenn die empfangenen Clocks um mehr als eine
+ * Millisekunde schwanken. Damit kein Tick verloren geht oder dazu kommt, darf
+ * der Taktgeber den empfangenen Clocks höchstens eine Clock vorauslaufen und
+ * holt beschleunigt auf, wenn er mehr als eine Clock zurückliegt.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "bits.h"
+#include "timer.h"
+#include "midi.h"
+#include "clock.h"
+
+/**
+ * Timer-Ticks pro Minute, mal 10 (Tempo in 1/10 BPM), geteilt durch die
+ * Ticks pro Viertelnote
+ *
+ * Geteilt durch das Tempo ergibt sich der Abstand zweier Ticks in Timer-Ticks.
+ */
+#define CLOCK_TICKS_FACTOR (F_CPU / TIMER_PRESCALE * 60UL * 10UL / (24UL * CLOCK_TICKS_PER_CLOCK))
+
+/**
+ * Mindestabstand in Timer-Ticks, mit dem ein Compare-Zeitpunkt in der Zukunft
+ * liegen muss, damit er nicht verpasst wird
+ */
+#define CLOCK_MIN_LEAD 16
+
+/**
+ * Anzahl aufeinanderfolgender Clocks mit kleiner Phasenabweichung, nach denen
+ * die PLL als eingerastet gilt
+ */
+#define CLOCK_LOCK_COUNT 8
+
+/**
+ * Zustand des Tick-Generators, wird vom Compare-Match-Interrupt verwendet
+ */
+struct {
+	/// Quelle der Midi-Clock
+	uint8_t source;
+
+	/// Der interne Takt läuft
+	uint8_t running;
+
+	/// Tempo des internen Taktes in 1/10 BPM
+	uint16_t tempo;
+
+	/// Abstand zweier Ticks beim eingestellten Tempo, ganzzahliger Anteil
+	uint16_t tempo_interval;
+
+	/// Abstand zweier Ticks beim eingestellten Tempo, Nachkomma-Anteil in 1/256
+	uint8_t tempo_fraction;
+
+	/// Aktueller Abstand zweier Ticks in Timer-Ticks, ganzzahliger Anteil
+	uint16_t interval;
+
+	/// Aktueller Abstand zweier Ticks, Nachkomma-Anteil in 1/256 Timer-Ticks
+	uint8_t interval_fraction;
+
+	/// Bisher aufgelaufener Nachkomma-Anteil
+	uint8_t phase_fraction;
+
+	/// Nummer des nächsten Ticks innerhalb einer Clock, 0 fällt auf eine Clock
+	uint8_t phase;
+
+	/// Erzeugte minus empfangene Clocks (nur bei externer Clock)
+	int8_t lead;
+
+	/// Der Generator wartet auf eine empfangene Clock
+	uint8_t holding;
+
+	/// Zeitpunkt des zuletzt erzeugten Ticks, der auf eine Clock fiel
+	uint16_t aligned;
+} clock_state;
+
+/**
+ * Zustand der PLL, wird nur aus clock_follow und clock_relock verwendet
+ */
+struct {
+	/// Auf die erste Clock nach Start, Continue oder SPP warten
+	unsigned relock:1;
+
+	/// Noch keine Periode seit dem letzten Neu-Einrasten gemessen
+	unsigned fresh:1;
+
+	/// Die PLL ist eingerastet
+	unsigned locked:1;
+
+	/// Anzahl der Clocks mit kleiner Phasenabweichung in Folge
+	uint8_t lock_count;
+
+	/// Zeitstempel der letzten empfangenen Clock
+	uint16_t last;
+
+	/// Geschätzte Periode einer Clock in 1/256 Timer-Ticks, 0 wenn unbekannt
+	uint32_t period;
+
+	/// Gleitender Mittelwert der Abweichung zwischen gemessener und geschätzter Periode
+	uint16_t jitter;
+} clock_pll;
+
+/*
+ * Den Taktgeber initialisieren
+ */
+void clock_init(void)
+{
+	clock_state.source = CLOCK_SOURCE_EXTERNAL;
+	clock_state.running = 0;
+	clock_set_tempo(CLOCK_TEMPO_DEFAULT);
+	clock_relock();
+}
+
+/*
+ * Die Quelle der Midi-Clock wählen
+ */
+void clock_set_source(uint8_t source)
+{
+	if(source == clock_state.source)
+		return;
+
+	// einen laufenden internen Takt anhalten
+	clock_stop();
+
+	// Generator anhalten, bei externer Clock startet ihn die nächste Clock
+	clock_relock();
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock_state.source = source;
+		clock_state.interval = clock_state.tempo_interval;
+		clock_state.interval_fraction = clock_state.tempo_fraction;
+	}
+}
+
+/*
+ * Die aktuelle Quelle der Midi-Clock
+ */
+uint8_t clock_get_source(void)
+{
+	return clock_state.source;
+}
+
+/*
+ * Das Tempo des internen Taktes in 1/10 BPM setzen
+ */
+void clock_set_tempo(uint16_t tempo)
+{
+	if(tempo < CLOCK_TEMPO_MIN) tempo = CLOCK_TEMPO_MIN;
+	if(tempo > CLOCK_TEMPO_MAX) tempo = CLOCK_TEMPO_MAX;
+
+	// Abstand zweier Ticks mit 8 Nachkomma-Bits ausrechnen, ohne dass
+	// ein Zwischenergebnis 32 Bit überschreitet
+	uint16_t interval = CLOCK_TICKS_FACTOR / tempo;
+	uint16_t rest = CLOCK_TICKS_FACTOR % tempo;
+	uint8_t fraction = ((uint32_t)rest << 8) / tempo;
+
+	// Der Interrupt darf keine halb geschriebenen Werte sehen
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock_state.tempo = tempo;
+		clock_state.tempo_interval = interval;
+		clock_state.tempo_fraction = fraction;
+
+		if(clock_state.source == CLOCK_SOURCE_INTERNAL)
+		{
+			clock_state.interval = interval;
+			clock_state.interval_fraction = fraction;
+		}
+	}
+}
+
+/*
+ * Das Tempo des internen Taktes in 1/10 BPM
+ */
+uint16_t clock_get_tempo(void)
+{
+	return clock_state.tempo;
+}
+
+/**
+ * Eine Realtime-Nachricht senden und an den Clock-Event-Handler weitergeben
+ */
+static void clock_realtime(uint8_t type)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		midi_send(type);
+		midi_event_push(type, CLOCK_SOURCE_INTERNAL, 0, TCNT1);
+	}
+}
+
+/**
+ * Den Compare-Match-Interrupt scharf schalten
+ *
+ * Der nächste Tick fällt auf eine Clock und kommt nach delay Timer-Ticks.
+ * Muss mit gesperrten Interrupts aufgerufen werden.
+ */
+static void clock_arm(uint16_t delay)
+{
+	clock_state.phase = 0;
+	clock_state.phase_fraction = 0;
+	clock_state.holding = 0;
+	OCR1A = TCNT1 + delay;
+
+	// ein altes Compare-Flag löschen (durch Schreiben einer 1)
+	TIFR = BIT(OCF1A);
+	SETBIT(TIMSK, OCIE1A);
+}
+
+/*
+ * Den internen Takt von vorne starten
+ */
+void clock_start(void)
+{
+	if(clock_state.source != CLOCK_SOURCE_INTERNAL)
+		return;
+
+	clock_realtime(MIDI_START);
+
+	// die erste Clock kommt nach einer vollen Clock-Periode
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock_arm(clock_state.interval * CLOCK_TICKS_PER_CLOCK);
+		clock_state.running = 1;
+	}
+}
+
+/*
+ * Den internen Takt anhalten
+ */
+void clock_stop(void)
+{
+	if(!clock_state.running)
+		return;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		CLEARBIT(TIMSK, OCIE1A);
+		clock_state.running = 0;
+	}
+
+	clock_realtime(MIDI_STOP);
+}
+
+/*
+ * Den internen Takt fortsetzen
+ */
+void clock_continue(void)
+{
+	if(clock_state.source != CLOCK_SOURCE_INTERNAL || clock_state.running)
+		return;
+
+	clock_realtime(MIDI_CONTINUE);
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock_arm(clock_state.interval * CLOCK_TICKS_PER_CLOCK);
+		clock_state.running = 1;
+	}
+}
+
+/*
+ * Gibt 1 zurück, wenn der interne Takt läuft
+ */
+uint8_t clock_running(void)
+{
+	return clock_state.running;
+}
+
+/*
+ * Die PLL neu einrasten lassen
+ */
+void clock_relock(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// Generator anhalten, nur bei externer Clock (den internen Takt hält clock_stop an)
+		if(clock_state.source == CLOCK_SOURCE_EXTERNAL)
+			CLEARBIT(TIMSK, OCIE1A);
+
+		clock_state.holding = 0;
+	}
+
+	clock_pll.relock = 1;
+	clock_pll.locked = 0;
+	clock_pll.lock_count = 0;
+}
+
+/**
+ * Den aktuellen Tick-Abstand aus der geschätzten Clock-Periode übernehmen
+ *
+ * Muss mit gesperrten Interrupts aufgerufen werden.
+ */
+static void clock_apply_period(void)
+{
+	// Periode einer Clock in 1/256 Timer-Ticks, geteilt durch 4 Ticks pro Clock
+	uint32_t interval = clock_pll.period / CLOCK_TICKS_PER_CLOCK;
+
+	clock_state.interval = interval >> 8;
+	clock_state.interval_fraction = interval & 0xFF;
+}
+
+/*
+ * Eine empfangene Midi-Clock verarbeiten
+ */
+void clock_follow(uint16_t timestamp)
+{
+	if(clock_state.source != CLOCK_SOURCE_EXTERNAL)
+		return;
+
+	// Erste Clock nach dem Neu-Einrasten: der Generator beginnt sofort mit dem
+	// Tick dieser Clock, die Periode ist die zuletzt geschätzte oder, wenn noch
+	// keine bekannt ist, die des eingestellten Tempos
+	if(clock_pll.relock)
+	{
+		clock_pll.relock = 0;
+		clock_pll.fresh = 1;
+		clock_pll.last = timestamp;
+
+		if(clock_pll.period == 0)
+			clock_pll.period = (((uint32_t)clock_state.tempo_interval << 8) | clock_state.tempo_fraction) * CLOCK_TICKS_PER_CLOCK;
+
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			clock_apply_period();
+
+			// der sofort folgende Tick gleicht diese Clock aus
+			clock_state.lead = -1;
+			clock_arm(CLOCK_MIN_LEAD);
+		}
+
+		return;
+	}
+
+	// Periode seit der letzten Clock messen
+	uint16_t measured = timestamp - clock_pll.last;
+	clock_pll.last = timestamp;
+
+	uint16_t period = clock_pll.period >> 8;
+	uint16_t deviation = (measured > period) ? measured - period : period - measured;
+	if(deviation > INT16_MAX)
+		deviation = INT16_MAX;
+
+	// Jitter als gleitenden Mittelwert der Abweichung führen
+	clock_pll.jitter += ((int16_t)deviation - (int16_t)clock_pll.jitter) / 16;
+
+	// Periode filtern: nach dem Einrasten oder bei einem Tempo-Sprung (mehr als
+	// Faktor 2) direkt übernehmen, sonst zu 1/8 nachführen
+	uint32_t measured_fp = (uint32_t)measured << 8;
+	if(clock_pll.fresh || measured > (uint32_t)period * 2 || measured < period / 2)
+		clock_pll.period = measured_fp;
+	else
+		clock_pll.period += ((int32_t)(measured_fp - clock_pll.period)) / 8;
+
+	clock_pll.fresh = 0;
+
+	int16_t error;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		clock_apply_period();
+
+		clock_state.lead--;
+
+		if(clock_state.lead >= 0)
+		{
+			// Der Tick dieser Clock ist bereits erzeugt worden, der Generator war
+			// um error zu früh
+			error = timestamp - clock_state.aligned;
+		}
+		else
+		{
+			// Der Tick dieser Clock steht noch aus, der Generator ist um error zu spät
+			uint8_t remaining = (CLOCK_TICKS_PER_CLOCK - clock_state.phase) % CLOCK_TICKS_PER_CLOCK;
+			error = timestamp - (OCR1A + remaining * clock_state.interval);
+		}
+
+		if(clock_state.holding)
+		{
+			// Der Generator wartet auf diese Clock: neu aufsetzen, der nächste Tick
+			// fällt auf die nächste erwartete Clock
+			clock_arm(clock_state.interval * CLOCK_TICKS_PER_CLOCK - (uint16_t)(TCNT1 - timestamp));
+		}
+		else
+		{
+			// Ein Viertel der Phasenabweichung auf den nächsten Tick anrechnen,
+			// aber keinen Zeitpunkt in der Vergangenheit setzen
+			uint16_t next = OCR1A + error / 4;
+			if((int16_t)(next - TCNT1) < CLOCK_MIN_LEAD)
+				next = TCNT1 + CLOCK_MIN_LEAD;
+			OCR1A = next;
+		}
+	}
+
+	// eingerastet, wenn die Phasenabweichung mehrfach in Folge unter 1/16 Clock liegt
+	uint16_t error_abs = (error < 0) ? -error : error;
+	if(error_abs < period / 16)
+	{
+		if(clock_pll.lock_count < CLOCK_LOCK_COUNT)
+			clock_pll.lock_count++;
+		else
+			clock_pll.locked = 1;
+	}
+	else
+	{
+		clock_pll.lock_count = 0;
+		clock_pll.locked = 0;
+	}
+}
+
+/*
+ * Gibt 1 zurück, wenn die PLL eingerastet ist
+ */
+uint8_t clock_locked(void)
+{
+	return clock_pll.locked;
+}
+
+/*
+ * Gemessener Jitter der empfangenen Clock in µs
+ */
+uint16_t clock_jitter(void)
+{
+	return (uint32_t)clock_pll.jitter * 1000UL / TIMER_TICKS_PER_MS;
+}
+
+/*
+ * Aktueller Abstand zweier Ticks
+ */
+uint16_t clock_tick_interval(void)
+{
+	uint16_t interval;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		interval = clock_state.interval;
+	}
+
+	return interval;
+}
+
+/**
+ * Compare-Match-Interrupt von Timer1: ein Tick
+ */
+ISR(TIMER1_COMPA_vect)
+{
+	// Sollzeitpunkt dieses Ticks
+	uint16_t now = OCR1A;
+
+	// Dieser Tick fällt auf eine Clock
+	if(clock_state.phase == 0)
+	{
+		if(clock_state.source == CLOCK_SOURCE_INTERNAL)
+		{
+			// Clock an angeschlossene Geräte senden
+			midi_send(MIDI_CLOCK);
+		}
+		else
+		{
+			// höchstens eine Clock vorauslaufen, sonst auf die empfangene Clock warten
+			if(clock_state.lead > 0)
+			{
+				CLEARBIT(TIMSK, OCIE1A);
+				clock_state.holding = 1;
+				return;
+			}
+
+			clock_state.lead++;
+			clock_state.aligned = now;
+		}
+	}
+
+	if(++clock_state.phase == CLOCK_TICKS_PER_CLOCK)
+		clock_state.phase = 0;
+
+	// nächsten Sollzeitpunkt setzen, dabei den Übertrag
+	// der Nachkomma-Anteile mitnehmen
+	uint8_t phase = clock_state.phase_fraction;
+	uint8_t next = phase + clock_state.interval_fraction;
+	uint16_t interval = clock_state.interval + (next < phase ? 1 : 0);
+	clock_state.phase_fraction = next;
+
+	// mehr als eine Clock im Rückstand: mit vierfacher Geschwindigkeit aufholen
+	if(clock_state.lead < -1)
+		interval /= 4;
+
+	// Wurde der Interrupt so lange aufgehalten, dass der nächste Zeitpunkt schon
+	// vorbei ist, würde der Compare erst nach einem Timer-Überlauf kommen
+	uint16_t compare = now + interval;
+	if((int16_t)(compare - TCNT1) < CLOCK_MIN_LEAD)
+		compare = TCNT1 + CLOCK_MIN_LEAD;
+	OCR1A = compare;
+
+	// Tick verarbeiten
+	midi_event_push(CLOCK_TICK, clock_state.source, 0, now);
+}
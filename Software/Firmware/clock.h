@@ -0,0 +1,164 @@
+/**
+ * @file
+ * Interner Taktgeber und Clock-Folger auf Basis von Timer1, externes Interface
+ *
+ * Timer1 erzeugt über seinen Compare-Match-Interrupt Ticks mit der vierfachen
+ * Auflösung der Midi-Clock (96 ppqn), die den Clock-Event-Handler treiben.
+ *
+ * Im internen Modus ergibt sich der Abstand der Ticks aus dem eingestellten
+ * Tempo, zu jedem vierten Tick wird eine Midi-Clock an angeschlossene Geräte
+ * gesendet.
+ *
+ * Bei externer Clock rastet der Taktgeber als PLL auf die empfangenen
+ * Midi-Clocks ein und erzeugt daraus gleichmäßige Ticks, so dass der Jitter
+ * von z.B. USB-Midi-Interfaces nicht auf die Trigger durchschlägt.
+ *
+ * In beiden Fällen treiben die Ticks denselben Clock-Event-Handler, so dass der
+ * Sequencer nicht wissen muss, welche Quelle aktiv ist.
+ */
+
+#ifndef CLOCK_H_
+#define CLOCK_H_
+
+#include <stdint.h>
+
+/**
+ * Die Midi-Clock kommt von einem externen Gerät
+ */
+#define CLOCK_SOURCE_EXTERNAL 0
+
+/**
+ * Die Midi-Clock wird intern erzeugt und an externe Geräte gesendet
+ */
+#define CLOCK_SOURCE_INTERNAL 1
+
+/**
+ * Anzahl der erzeugten Ticks pro Midi-Clock
+ *
+ * Bei 24 Midi-Clocks pro Viertelnote ergeben sich 96 Ticks pro Viertelnote.
+ */
+#define CLOCK_TICKS_PER_CLOCK 4
+
+/**
+ * Ereignis-Typ eines erzeugten Ticks
+ *
+ * Entspricht dem in der Midi-Spezifikation nicht belegten Realtime-Byte 0xF9,
+ * wird aber nur intern verwendet und nie gesendet.
+ *
+ * @see midi_event_push
+ */
+#define CLOCK_TICK 0xF9
+
+/**
+ * Kleinstes einstellbares Tempo in 1/10 BPM
+ *
+ * Bei 20 BPM liegen zwei Clocks 125ms auseinander, was gerade noch in einen
+ * 16-Bit-Timer-Intervall (131ms) passt.
+ */
+#define CLOCK_TEMPO_MIN 200
+
+/**
+ * Größtes einstellbares Tempo in 1/10 BPM
+ */
+#define CLOCK_TEMPO_MAX 3000
+
+/**
+ * Tempo nach dem Einschalten in 1/10 BPM
+ */
+#define CLOCK_TEMPO_DEFAULT 1200
+
+/**
+ * Den Taktgeber initialisieren
+ *
+ * Erwartet, dass Timer1 bereits mit timer_init gestartet wurde.
+ */
+void clock_init(void);
+
+/**
+ * Die Quelle der Midi-Clock wählen
+ *
+ * Beim Wechsel auf die externe Quelle wird ein laufender interner Takt
+ * angehalten.
+ *
+ * @see CLOCK_SOURCE_EXTERNAL
+ * @see CLOCK_SOURCE_INTERNAL
+ */
+void clock_set_source(uint8_t source);
+
+/**
+ * Die aktuelle Quelle der Midi-Clock
+ */
+uint8_t clock_get_source(void);
+
+/**
+ * Das Tempo des internen Taktes in 1/10 BPM setzen
+ *
+ * Werte außerhalb von CLOCK_TEMPO_MIN bis CLOCK_TEMPO_MAX werden begrenzt.
+ * Die Änderung wird ab der nächsten Clock wirksam.
+ */
+void clock_set_tempo(uint16_t tempo);
+
+/**
+ * Das Tempo des internen Taktes in 1/10 BPM
+ */
+uint16_t clock_get_tempo(void);
+
+/**
+ * Den internen Takt von vorne starten und eine Midi-Start-Nachricht senden
+ */
+void clock_start(void);
+
+/**
+ * Den internen Takt anhalten und eine Midi-Stop-Nachricht senden
+ */
+void clock_stop(void);
+
+/**
+ * Den internen Takt fortsetzen und eine Midi-Continue-Nachricht senden
+ */
+void clock_continue(void);
+
+/**
+ * Gibt 1 zurück, wenn der interne Takt läuft
+ */
+uint8_t clock_running(void);
+
+/**
+ * Eine empfangene Midi-Clock an die PLL übergeben
+ *
+ * timestamp ist der Timer1-Zählerstand beim Empfang. Wird von midi_dispatch
+ * im Hauptprogramm aufgerufen.
+ */
+void clock_follow(uint16_t timestamp);
+
+/**
+ * Die PLL neu einrasten lassen
+ *
+ * Hält den Tick-Generator an, bis die nächste Midi-Clock empfangen wird. Ab
+ * dieser Clock laufen die Ticks phasengleich weiter. Wird bei Start, Stop,
+ * Continue und Song-Position-Pointer aufgerufen.
+ */
+void clock_relock(void);
+
+/**
+ * Gibt 1 zurück, wenn die PLL auf die externe Clock eingerastet ist
+ */
+uint8_t clock_locked(void);
+
+/**
+ * Gemessener Jitter der externen Clock in µs
+ *
+ * Gleitender Mittelwert der Abweichung zwischen dem gemessenen Abstand zweier
+ * Clocks und der geschätzten Periode.
+ */
+uint16_t clock_jitter(void);
+
+/**
+ * Aktueller Abstand zweier Ticks in Timer1-Ticks
+ *
+ * Im internen Modus aus dem Tempo abgeleitet, bei externer Clock aus der von
+ * der PLL geschätzten Periode.
+ */
+uint16_t clock_tick_interval(void);
+
+#endif /* CLOCK_H_ */
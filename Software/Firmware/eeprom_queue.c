@@ -0,0 +1,209 @@
+/**
+ * @file
+ * Schreiben in das EEPROM im Hintergrund
+ *
+ * head wird nur beim Einreihen (immer atomar) geschrieben, tail und die
+ * Einträge ab tail nur vom EE_RDY-Interrupt. Der Interrupt wird beim Einreihen
+ * eingeschaltet und schaltet sich selbst ab, sobald nichts mehr zu tun ist.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "bits.h"
+#include "eeprom_queue.h"
+
+/**
+ * Ein Schreibauftrag
+ */
+typedef struct {
+	/// Nächstes zu prüfendes Byte im EEPROM
+	uint8_t *eeprom;
+
+	/// Zugehöriges Byte im RAM
+	const uint8_t *ram;
+
+	/// Anzahl der noch zu prüfenden Bytes
+	uint8_t length;
+} eeprom_queue_entry_t;
+
+/**
+ * Zustand der Warteschlange
+ */
+struct {
+	/// Die Schreibaufträge
+	eeprom_queue_entry_t entries[EEPROM_QUEUE_SIZE];
+
+	/// Schreib-Index (nächster freier Platz)
+	volatile uint8_t head;
+
+	/// Lese-Index (laufender Auftrag)
+	volatile uint8_t tail;
+
+	/// Ziel des ausstehenden Lesevorgangs
+	uint8_t *read_ram;
+
+	/// Quelle des ausstehenden Lesevorgangs
+	const uint8_t *read_eeprom;
+
+	/// Anzahl der noch zu lesenden Bytes, 0 wenn kein Lesevorgang aussteht
+	volatile uint8_t read_length;
+
+	/// Anzahl der geschriebenen Bytes
+	volatile uint16_t writes;
+} eeprom_queue;
+
+/**
+ * Das EEPROM ist bereit: ein Byte lesen oder vergleichen und ggf. schreiben
+ *
+ * Pro Auslösen wird nur ein Byte bearbeitet. Solange EERIE gesetzt und das
+ * EEPROM bereit ist, löst der Interrupt sofort wieder aus, Timer und UART
+ * haben aber Vorrang und kommen zwischen zwei Bytes zum Zug.
+ */
+ISR(EE_RDY_vect)
+{
+	// Ein Lesevorgang wird gebraucht, um ein Pattern rechtzeitig zu laden
+	if(eeprom_queue.read_length)
+	{
+		EEAR = (uint16_t)eeprom_queue.read_eeprom++;
+		SETBIT(EECR, EERE);
+		*eeprom_queue.read_ram++ = EEDR;
+		eeprom_queue.read_length--;
+		return;
+	}
+
+	// Nichts mehr zu tun: Interrupt abschalten, bis wieder etwas eingereiht wird
+	if(eeprom_queue.tail == eeprom_queue.head)
+	{
+		CLEARBIT(EECR, EERIE);
+		return;
+	}
+
+	eeprom_queue_entry_t *entry = &eeprom_queue.entries[eeprom_queue.tail];
+
+	if(entry->length)
+	{
+		uint8_t data = *entry->ram++;
+
+		EEAR = (uint16_t)entry->eeprom++;
+		entry->length--;
+
+		// Nur schreiben, was sich geändert hat
+		SETBIT(EECR, EERE);
+		if(EEDR != data)
+		{
+			EEDR = data;
+			SETBIT(EECR, EEMWE);
+			SETBIT(EECR, EEWE);
+
+			eeprom_queue.writes++;
+		}
+	}
+
+	// Der Auftrag ist abgearbeitet
+	if(!entry->length)
+		eeprom_queue.tail = (eeprom_queue.tail + 1) & (EEPROM_QUEUE_SIZE - 1);
+}
+
+/*
+ * Einen Bereich im Hintergrund schreiben
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t eeprom_queue_write(void *eeprom, const void *ram, uint8_t length)
+{
+	uint8_t head = eeprom_queue.head;
+	uint8_t next = (head + 1) & (EEPROM_QUEUE_SIZE - 1);
+
+	if(next == eeprom_queue.tail)
+		return 0;
+
+	eeprom_queue_entry_t *entry = &eeprom_queue.entries[head];
+	entry->eeprom = eeprom;
+	entry->ram = ram;
+	entry->length = length;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		eeprom_queue.head = next;
+		SETBIT(EECR, EERIE);
+	}
+
+	return 1;
+}
+
+/*
+ * Einen Bereich im Hintergrund lesen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t eeprom_queue_read(void *ram, const void *eeprom, uint8_t length)
+{
+	if(eeprom_queue.read_length)
+		return 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		eeprom_queue.read_ram = ram;
+		eeprom_queue.read_eeprom = eeprom;
+		eeprom_queue.read_length = length;
+		SETBIT(EECR, EERIE);
+	}
+
+	return 1;
+}
+
+/*
+ * Gibt 1 zurück, solange ein Lesevorgang aussteht
+ */
+uint8_t eeprom_queue_reading(void)
+{
+	return eeprom_queue.read_length ? 1 : 0;
+}
+
+/*
+ * Prüft, ob ein Schreibauftrag noch Bytes aus einem RAM-Bereich braucht
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t eeprom_queue_pending(const void *ram, uint8_t length)
+{
+	const uint8_t *begin = ram;
+	const uint8_t *end = begin + length;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		for(uint8_t i = eeprom_queue.tail; i != eeprom_queue.head; i = (i + 1) & (EEPROM_QUEUE_SIZE - 1))
+		{
+			const eeprom_queue_entry_t *entry = &eeprom_queue.entries[i];
+
+			// Der Auftrag überschneidet sich mit dem Bereich
+			if(entry->length && entry->ram < end && entry->ram + entry->length > begin)
+				return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Anzahl der ausstehenden Schreibaufträge
+ */
+uint8_t eeprom_queue_depth(void)
+{
+	return (eeprom_queue.head - eeprom_queue.tail) & (EEPROM_QUEUE_SIZE - 1);
+}
+
+/*
+ * Anzahl der geschriebenen Bytes
+ */
+uint16_t eeprom_queue_writes(void)
+{
+	uint16_t writes;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		writes = eeprom_queue.writes;
+	}
+
+	return writes;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file
+ * Schreiben in das EEPROM im Hintergrund, externes Interface
+ *
+ * Ein Byte im EEPROM zu schreiben dauert rund 8,5ms. Damit weder die Clock noch
+ * die Abfrage der Eingänge darauf warten müssen, werden Schreibaufträge nur in
+ * eine Warteschlange eingereiht. Ein Auftrag beschreibt einen Bereich im
+ * EEPROM und die Stelle im RAM, aus der er beschrieben werden soll.
+ *
+ * Abgearbeitet wird die Warteschlange vom EE_RDY-Interrupt, der jedes Mal
+ * auslöst, wenn das EEPROM wieder bereit ist: Er liest das nächste Byte des
+ * Bereichs und vergleicht es mit dem RAM, nur ein abweichendes Byte wird
+ * geschrieben. Pro Auslösen wird genau ein Byte bearbeitet, so dass der
+ * Interrupt nie lange läuft und Timer und UART zwischen zwei Bytes zum Zug
+ * kommen. Nach einem Schreibvorgang löst er erst nach dessen Ende wieder aus.
+ * Ist die Warteschlange leer, wird der Interrupt abgeschaltet.
+ *
+ * Die Bytes werden erst beim Schreiben aus dem RAM geholt. Der RAM-Bereich
+ * muss daher gültig bleiben, bis eeprom_queue_pending für ihn 0 liefert,
+ * spätere Änderungen daran werden aber mitgeschrieben, soweit der Auftrag die
+ * Stelle noch nicht passiert hat.
+ *
+ * Ein Lesevorgang hat Vorrang vor allen Schreibaufträgen und wird vom selben
+ * Interrupt ausgeführt, sobald kein Schreibvorgang mehr läuft. Direkt darf
+ * das Hauptprogramm das EEPROM nur vor dem Freigeben der Interrupts ansprechen,
+ * da der Interrupt sonst das Adressregister verändern kann.
+ */
+
+#ifndef EEPROM_QUEUE_H_
+#define EEPROM_QUEUE_H_
+
+#include <stdint.h>
+
+/**
+ * Größe der Warteschlange, muss eine Zweierpotenz sein
+ *
+ * Es passen EEPROM_QUEUE_SIZE - 1 Schreibaufträge hinein.
+ */
+#define EEPROM_QUEUE_SIZE 8
+
+/**
+ * Einen Bereich im Hintergrund aus dem RAM in das EEPROM schreiben
+ *
+ * Gibt 0 zurück, wenn die Warteschlange voll ist, der Auftrag muss dann später
+ * wiederholt werden.
+ */
+uint8_t eeprom_queue_write(void *eeprom, const void *ram, uint8_t length);
+
+/**
+ * Einen Bereich im Hintergrund aus dem EEPROM in das RAM lesen
+ *
+ * Es kann immer nur ein Lesevorgang ausstehen, gibt 0 zurück, wenn noch einer
+ * läuft.
+ */
+uint8_t eeprom_queue_read(void *ram, const void *eeprom, uint8_t length);
+
+/**
+ * Gibt 1 zurück, solange ein Lesevorgang aussteht
+ */
+uint8_t eeprom_queue_reading(void);
+
+/**
+ * Gibt 1 zurück, solange ein Schreibauftrag noch Bytes aus dem RAM-Bereich
+ * ram mit length Bytes holen muss
+ */
+uint8_t eeprom_queue_pending(const void *ram, uint8_t length);
+
+/**
+ * Anzahl der ausstehenden Schreibaufträge
+ */
+uint8_t eeprom_queue_depth(void);
+
+/**
+ * Anzahl der seit dem Einschalten geschriebenen Bytes
+ */
+uint16_t eeprom_queue_writes(void);
+
+#endif /* EEPROM_QUEUE_H_ */
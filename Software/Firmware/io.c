@@ -13,6 +13,11 @@
 #include "io_selector.h"
 #include "io_sequencer.h"
 
+/**
+ * Event-Handler, der zwischen den Multiplexer-Zyklen aufgerufen wird
+ */
+io_poll_handler poll_callback;
+
 /*
  * Die Peripherie initialisieren
  */
@@ -75,5 +80,16 @@ void io_sync(void)
 
 		// Werte der Parameter-Boards auslesen
 		io_parameter_sync(cycle);
+
+		// Zeitkritische Aufgaben des Hauptprogramms abarbeiten
+		if(poll_callback) poll_callback();
 	}
 }
+
+/*
+ * Den Event-Handler setzen, der zwischen den Multiplexer-Zyklen aufgerufen wird
+ */
+void io_set_poll_handler(io_poll_handler callback)
+{
+	poll_callback = callback;
+}
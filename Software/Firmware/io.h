@@ -57,6 +57,12 @@
 #define TIMER_PIN     PD2
 
 
+/**
+ * Definition eines Event-Handlers, der während der Synchronisation der
+ * Peripherie regelmäßig aufgerufen wird
+ */
+typedef void (*io_poll_handler)(void);
+
 /**
  * Die Peripherie initialisieren
  */
@@ -67,4 +73,14 @@ void io_init(void);
  */
 void io_sync(void);
 
+/**
+ * Den Event-Handler setzen, der zwischen den einzelnen Multiplexer-Zyklen
+ * aufgerufen wird
+ *
+ * Ein kompletter Durchlauf von io_sync dauert durch die AD-Wandlungen mehrere
+ * Millisekunden. Damit zeitkritische Aufgaben des Hauptprogramms nicht so lange
+ * warten müssen, wird dieser Handler nach jedem der 8 Zyklen aufgerufen.
+ */
+void io_set_poll_handler(io_poll_handler);
+
 #endif /* IO_H_ */
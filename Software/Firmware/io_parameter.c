@@ -25,7 +25,7 @@ struct parameter_state_struct
 	unsigned positive:1;
 
 	/// Zuletzt gelesener Wert
-	unsigned last:7;
+	unsigned last:10;
 } parameter_state[N_PARAMETERS];
 
 /**
@@ -33,7 +33,7 @@ struct parameter_state_struct
  *
  * gibt 1 für positiv und 0 für negativ oder null zurück
  */
-uint8_t is_positive(int8_t n)
+uint8_t is_positive(int16_t n)
 {
 	if (n > 0) return 1;
 	else return 0;
@@ -50,7 +50,7 @@ uint8_t is_positive(int8_t n)
  * logische Parameterkennung zu.
  *
  * Aus ähnlichen Gründen sind einige Potentiometer anders herum eingebaut, so dass
- * ein maximaler Ausschlag 0 und ein minimaler 127 bedeutet. Der invert-Parameter
+ * ein maximaler Ausschlag 0 und ein minimaler 1023 bedeutet. Der invert-Parameter
  * steuert, dass bei diesen der gemessene Wert invertiert wird.
  */
 struct {
@@ -97,7 +97,7 @@ void io_parameter_init()
 /**
  * Einen Parameter auslesen
  */
-uint8_t io_parameter_read(uint8_t chain)
+uint16_t io_parameter_read(uint8_t chain)
 {
 	// MUX-Register auf null
 	CLEARBITS(ADMUX, BIT(MUX0) | BIT(MUX1) | BIT(MUX2) | BIT(MUX3));
@@ -111,11 +111,9 @@ uint8_t io_parameter_read(uint8_t chain)
 	// auf Abschluss der Wandlung warten
 	while(BITSET(ADCSRA, ADSC));
 
-	// Wert messen
-	uint16_t temp = ADCW;
-
-	// Messwert auf 7 Bit reduzieren
-	return (temp >> 3);
+	// Wert mit voller Auflösung (10 Bit) messen, die Reduktion auf 7 Bit
+	// übernimmt bei Bedarf die Midi-Ausgabe
+	return ADCW;
 }
 
 /**
@@ -130,16 +128,16 @@ void io_parameter_readchip(uint8_t cycle, uint8_t chip)
 	uint8_t n = parameter_map[cycle].mapping + offset;
 
 	// Wert auslesen
-	uint8_t value = io_parameter_read(chip);
+	uint16_t value = io_parameter_read(chip);
 
 	// ggf. invertieren
 	if(parameter_map[cycle].invert)
-		value = 127 - value;
+		value = IO_PARAMETER_MAX - value;
 
 	struct parameter_state_struct *state = &parameter_state[n];
 
 	// Differenz zw. dem aktuellen und dem letzten Wert bilden
-	int8_t diff = ((int8_t)value - (int8_t)state->last);
+	int16_t diff = ((int16_t)value - (int16_t)state->last);
 
 	// Anhand der Differenz entscheiden, was getan werden soll
 	if(diff == 0)
@@ -8,10 +8,17 @@
 
 #include "io_config.h"
 
+/**
+ * Größter Wert eines Parameters
+ *
+ * Die Parameter werden mit der vollen Auflösung des ADC (10 Bit) gemeldet.
+ */
+#define IO_PARAMETER_MAX 1023
+
 /**
  * Definition eines Event-Handler für das Drehen des Selektorrads
  */
-typedef void (*io_parameter_changed_handler)(uint8_t parameter, uint8_t value);
+typedef void (*io_parameter_changed_handler)(uint8_t parameter, uint16_t value);
 
 /**
  * Die Parameter-Boards initialisieren
@@ -15,6 +15,13 @@
 #include "io_parameter.h"
 #include "io_sequencer.h"
 #include "midi.h"
+#include "midi_control.h"
+#include "midi_sense.h"
+#include "timer.h"
+#include "clock.h"
+#include "pattern.h"
+#include "song.h"
+#include "track.h"
 #include "instrument_names.h"
 
 // Forwärts-Deklaration der Event-Handler
@@ -22,17 +29,67 @@ void io_selector_pressed(void);
 void io_selector_released(void);
 void io_selector_left(void);
 void io_selector_right(void);
-void io_parameter_changed(uint8_t parameter, uint8_t value);
+void io_parameter_changed(uint8_t parameter, uint16_t value);
 void midi_clock(uint8_t);
+void midi_tick(void);
 
-// Forwärts-Deklaration der Instrumenten-Anzeige-Routine
+// Forwärts-Deklaration der Anzeige-Routinen
 void print_selected_instrument(void);
+void print_menu(void);
+void print_clock_status(void);
+void print_errors(void);
+void print_pattern_status(void);
 
 /**
  * Mit dem Selektorrad ausgewähltes Instrument
  */
 uint8_t selected_instrument = 0;
 
+/**
+ * Seiten des Menüs
+ *
+ * Ein kurzer Druck auf das Selektorrad wechselt zur nächsten Seite, Drehen
+ * ändert den Wert der aktuellen Seite.
+ */
+enum {
+	/// Auswahl des Instruments
+	MENU_INSTRUMENT,
+
+	/// Midi-Kanal des ausgewählten Instruments
+	MENU_CHANNEL,
+
+	/// Midi-Note des ausgewählten Instruments
+	MENU_NOTE,
+
+	/// Quelle der Midi-Clock, Start & Stop des internen Taktes
+	MENU_CLOCK,
+
+	/// Tempo des internen Taktes
+	MENU_TEMPO,
+
+	/// Zähler der Empfangsfehler (nur Anzeige, in der Zeile des Tempos)
+	MENU_ERRORS,
+
+	/// Anzahl der Menü-Seiten
+	N_MENU_PAGES
+};
+
+/**
+ * Aktuelle Seite des Menüs
+ */
+uint8_t menu_page = MENU_INSTRUMENT;
+
+/**
+ * Zustand des Selektorrad-Tasters
+ */
+struct {
+	/// Der Taster ist gedrückt
+	unsigned held:1;
+
+	/// Während der Taster gedrückt war, wurde das Rad gedreht
+	unsigned turned:1;
+} selector_state;
+
 /**
  * Einstiegspunkt des Hauptprogramms
  */
@@ -49,18 +106,33 @@ main(void)
 	io_selector_set_right_handler(io_selector_right);
 	io_parameter_set_changed_handler(io_parameter_changed);
 
+	// Empfangene Midi-Ereignisse zwischen den Multiplexer-Zyklen abarbeiten
+	io_set_poll_handler(midi_dispatch);
+
 	// Das LCD-Display aktivieren
 	lcd_init();
 
 	// Programmnamen ausgeben
 	lcd_pstring(PSTR("The Microdrum"));
 
-	// aktuellen Instrumentennamen ausgeben
-	print_selected_instrument();
+	// Zeitbasis für Zeitstempel starten
+	timer_init();
 
-	// Midi aktivieren
+	// Internen Taktgeber vorbereiten (startet mit externer Clock)
+	clock_init();
+
+	// Das erste Pattern aus dem EEPROM laden
+	pattern_init();
+
+	// Einen gespeicherten Song laden
+	song_init();
+
+	// Midi aktivieren, lädt auch Kanal und Note der Instrumente aus dem EEPROM
 	midi_init();
 
+	// aktuellen Instrumentennamen und das Menü ausgeben
+	print_menu();
+
 	// den Midi-Clock Callback definieren
 	//   er soll alle 6 Midi-Clocks aufgerufen werden (das entspricht 16tel Noten),
 	//   dabei sollen 8 Steps durchgezählt werden (von 0 bis 7)
@@ -68,182 +140,413 @@ main(void)
 	//     beim Clock-Reset (neu Aufsetzen nach Pause oder Spulen)
 	midi_set_clock_interrupt(midi_clock, 6, N_STEPS);
 
+	// Die Spuren zählen mit eigener Länge und eigenem Tempo in jedem Tick weiter
+	midi_set_tick_handler(midi_tick);
+
 	// Das Hauptprogramm versinkt in einer Endlosschleife, welche die Eingaben der
 	// Buttons abnimmt, die LEDs ansteuert und Änderungen an den Drehknöpfen
 	// abliest.
-	// Unterbrochen wird es durch Midi-Eingaben (siehe midi.c), wozu auch
-	// Midi-Clock-Nachrichten gehören. Diese unterbrechen den normalen Programmablauf
-	// und senden entsprechend dem aktuellen Zustand Midi-Noten zurück.
-	for(;;) io_sync();
+	// Midi-Eingaben (siehe midi.c), wozu auch Midi-Clock-Nachrichten gehören, werden
+	// vom Empfangs-Interrupt nur in eine Warteschlange gelegt. Zwischen den
+	// Multiplexer-Zyklen arbeitet midi_dispatch diese ab und sendet entsprechend dem
+	// aktuellen Zustand Midi-Noten zurück.
+	for(;;)
+	{
+		io_sync();
+		pattern_poll();
+		song_poll();
+		print_clock_status();
+		print_pattern_status();
+	}
 
 	// Programmende
 	return 0;
 }
 
 /**
- * Das aktuell ausgewählte Instrument auf dem LCD ausgeben
+ * Markierung der aktuellen Menü-Seite ausgeben
+ */
+void print_menu_marker(uint8_t page)
+{
+	lcd_data(menu_page == page ? '>' : ' ');
+}
+
+/**
+ * Das aktuell ausgewählte Instrument mit Midi-Kanal und Note auf dem LCD ausgeben
+ *
+ * Kanal und Note haben eigene Menü-Seiten, deren Markierung direkt vor dem
+ * Wert steht.
  */
 void print_selected_instrument(void)
 {
+	midi_instrument_t *map = &midi_instruments[selected_instrument];
+
 	lcd_setcursor(0, 1);
+	print_menu_marker(MENU_INSTRUMENT);
 	lcd_uint8(selected_instrument + 1);
 	lcd_pstring(PSTR("/8 "));
 	lcd_pstring(names[selected_instrument]);
-	lcd_space(5);
+	lcd_space(7 - strlen_P(names[selected_instrument]));
+
+	// Midi-Kanal (1-16) rechtsbündig
+	print_menu_marker(MENU_CHANNEL);
+	if(map->channel < 9)
+		lcd_data(' ');
+	lcd_uint8(map->channel + 1);
+
+	print_menu_marker(MENU_NOTE);
+	midi_print_notename(map->note);
 }
 
 /**
- * Event-Handler für das Niederdrücken des Selektorrads
- *
- * @see io_selector_set_released_handler
+ * Die Quelle der Midi-Clock auf dem LCD ausgeben
  */
-void io_selector_pressed(void)
+void print_clock(void)
 {
 	lcd_setcursor(0, 2);
-	lcd_pstring(PSTR("pressed"));
+	print_menu_marker(MENU_CLOCK);
+	lcd_pstring(PSTR("Clock "));
+
+	if(clock_get_source() == CLOCK_SOURCE_EXTERNAL)
+	{
+		if(midi_sense_lost())
+			lcd_pstring(PSTR("Extern Lost"));
+		else
+			lcd_pstring(clock_locked() ? PSTR("Extern Lock") : PSTR("Extern     "));
+	}
+	else if(clock_running())
+		lcd_pstring(PSTR("Intern Play"));
+	else
+		lcd_pstring(PSTR("Intern Stop"));
 }
 
 /**
- * Event-Handler für das Loslassen des Selektorrads nach dem Niederdrücken
+ * Das Tempo des internen Taktes auf dem LCD ausgeben
  *
- * @see io_selector_set_pressed_handler
+ * Bei externer Clock wird stattdessen der gemessene Jitter angezeigt, solange
+ * die Tempo-Seite nicht ausgewählt ist.
  */
-void io_selector_released(void)
+void print_tempo(void)
 {
-	lcd_setcursor(0, 2);
-	lcd_space(7);
+	// Die Fehler-Seite teilt sich die Zeile mit dem Tempo
+	if(menu_page == MENU_ERRORS)
+	{
+		print_errors();
+		return;
+	}
+
+	lcd_setcursor(0, 3);
+	print_menu_marker(MENU_TEMPO);
+
+	if(clock_get_source() == CLOCK_SOURCE_EXTERNAL && menu_page != MENU_TEMPO)
+	{
+		lcd_pstring(PSTR("Jitter "));
+		lcd_uint16(clock_jitter());
+		lcd_pstring(PSTR(" us"));
+	}
+	else
+	{
+		uint16_t tempo = clock_get_tempo();
+
+		lcd_pstring(PSTR("Tempo "));
+		lcd_uint16(tempo / 10);
+		lcd_data('.');
+		lcd_data('0' + tempo % 10);
+		lcd_pstring(PSTR(" BPM"));
+	}
+
+	lcd_space(4);
 }
 
 /**
- * Event-Handler, der aufgerufen wird, wenn das Selektorrad einen Schritt
- * nach links gedreht wurde
- *
- * @see io_selector_set_left_handler
+ * Einen Zähler rechtsbündig mit 5 Stellen ausgeben, damit er die Zeile beim
+ * Wachsen nicht verschiebt
  */
-void io_selector_left(void)
+void print_counter(uint16_t n)
 {
-	if(selected_instrument == 0)
-		selected_instrument = N_INSTRUMENTS-1;
-	else
-		selected_instrument--;
+	for(uint16_t limit = 10000; limit > 1 && n < limit; limit /= 10)
+		lcd_data(' ');
 
-	print_selected_instrument();
+	lcd_uint16(n);
 }
 
 /**
- * Event-Handler, der aufgerufen wird, wenn das Selektorrad einen Schritt
- * nach rechts gedreht wurde
+ * Die Zähler der Framing-Fehler und Überläufe des Midi-Empfangs auf dem LCD
+ * ausgeben
+ */
+void print_errors(void)
+{
+	lcd_setcursor(0, 3);
+	print_menu_marker(MENU_ERRORS);
+	lcd_pstring(PSTR("Err F"));
+	print_counter(midi_rx_errors(MIDI_RX_FRAMING));
+	lcd_pstring(PSTR(" O"));
+	print_counter(midi_rx_errors(MIDI_RX_OVERRUN));
+	lcd_space(2);
+}
+
+/**
+ * Den Zustand der externen Clock regelmäßig auf dem LCD auffrischen
  *
- * @see io_selector_set_right_handler
+ * Wird nach jedem Durchlauf von io_sync aufgerufen, das LCD wird aber nur alle
+ * 32 Durchläufe beschrieben, damit die Ausgabe den Durchlauf nicht bremst. Auf
+ * der Fehler-Seite werden so auch die Zähler aufgefrischt.
  */
-void io_selector_right(void)
+void print_clock_status(void)
 {
-	if(selected_instrument == N_INSTRUMENTS-1)
-		selected_instrument = 0;
-	else
-		selected_instrument++;
+	static uint8_t count = 0;
 
-	print_selected_instrument();
+	if((clock_get_source() != CLOCK_SOURCE_EXTERNAL && menu_page != MENU_ERRORS) || ++count % 32)
+		return;
+
+	print_clock();
+	print_tempo();
 }
 
 /**
- * Event-Handler, der aufgerufen wird, wenn sich ein Parameter geändert hat.
- * Als Antwort wird eine Midi-CC-Nachricht gesendet
+ * Das aktuelle und das vorgemerkte Pattern rechts neben dem Programmnamen ausgeben
  *
- * @see io_parameter_set_changed_handler
+ * Wird nach jedem Durchlauf von io_sync aufgerufen und schreibt nur dann auf
+ * das LCD, wenn sich die Auswahl geändert hat. Der Wechsel selbst passiert
+ * während des Steps, die Ausgabe darf die Trigger nicht verzögern.
+ */
+void print_pattern_status(void)
+{
+	static uint8_t current = PATTERN_NONE;
+	static uint8_t pending = PATTERN_NONE;
+
+	if(pattern_current() == current && pattern_pending() == pending)
+		return;
+
+	current = pattern_current();
+	pending = pattern_pending();
+
+	lcd_setcursor(15, 0);
+	lcd_data('P');
+	lcd_data('1' + current);
+
+	if(pending != PATTERN_NONE)
+	{
+		lcd_data('>');
+		lcd_data('1' + pending);
+	}
+	else
+		lcd_space(2);
+}
+
+/**
+ * Alle Menü-Seiten auf dem LCD ausgeben
  */
-void io_parameter_changed(uint8_t parameter, uint8_t value)
+void print_menu(void)
 {
-	midi_cc(parameter, value);
+	print_selected_instrument();
+	print_clock();
+	print_tempo();
 }
 
 /**
- * Event-Handler, der aufgerufen wird, wenn eine gewisse Anzahl von
- * Midi-Clock-Nachrichten registriert wurden.
+ * Die Quelle der Midi-Clock ändern
  *
- * Achtung: eine Interrupt-Routine
- *
- * @see midi_set_clock_interrupt
+ * Die Einstellungen Extern, Intern gestoppt und Intern laufend werden der Reihe
+ * nach durchgeschaltet.
  */
-void midi_clock(uint8_t beat)
+void menu_change_clock(int8_t direction)
 {
-	io_sequencer_set(beat);
-	midi_detrigger_instruments();
+	// aktuelle Einstellung: 0 = Extern, 1 = Intern Stop, 2 = Intern Play
+	uint8_t setting = 0;
+	if(clock_get_source() == CLOCK_SOURCE_INTERNAL)
+		setting = clock_running() ? 2 : 1;
+
+	if(direction < 0 && setting > 0) setting--;
+	if(direction > 0 && setting < 2) setting++;
 
-	switch(beat)
+	switch(setting)
 	{
 		case 0: {
-			midi_trigger_instrument(0, 70); // Bass Drum
+			clock_set_source(CLOCK_SOURCE_EXTERNAL);
 			break;
 		}
 
 		case 1: {
+			clock_set_source(CLOCK_SOURCE_INTERNAL);
+			clock_stop();
 			break;
 		}
 
 		case 2: {
-			midi_trigger_instrument(5, 70); // Closed Hi Hat
+			clock_set_source(CLOCK_SOURCE_INTERNAL);
+			if(!clock_running()) clock_start();
 			break;
 		}
+	}
 
-		case 3: {
-			break;
-		}
+	print_clock();
+}
 
-		case 4: {
-			midi_trigger_instrument(1, 70); // Snare Drum
-			midi_trigger_instrument(2, 70); // Mid-Tom
-			break;
-		}
+/**
+ * Den Wert der aktuellen Menü-Seite um einen Schritt ändern
+ */
+void menu_change(int8_t direction)
+{
+	// Drehen bei gedrücktem Taster wechselt nicht die Seite beim Loslassen
+	if(selector_state.held)
+		selector_state.turned = 1;
 
-		case 5: {
-			break;
-		}
+	switch(menu_page)
+	{
+		case MENU_INSTRUMENT: {
+			if(direction < 0)
+				selected_instrument = (selected_instrument == 0) ? N_INSTRUMENTS-1 : selected_instrument-1;
+			else
+				selected_instrument = (selected_instrument == N_INSTRUMENTS-1) ? 0 : selected_instrument+1;
 
-		case 6: {
-			midi_trigger_instrument(5, 70); // Closed Hi Hat
+			print_selected_instrument();
 			break;
 		}
 
-		case 7: {
-			break;
-		}
+		case MENU_CHANNEL: {
+			midi_instrument_t *map = &midi_instruments[selected_instrument];
+			int8_t channel = map->channel + direction;
 
-		case 8: {
-			midi_trigger_instrument(0, 70); // Bass Drum
-			break;
-		}
+			if(channel >= 0 && channel <= 15)
+				midi_set_instrument(selected_instrument, channel, map->note);
 
-		case 9: {
+			print_selected_instrument();
 			break;
 		}
 
-		case 10: {
-			midi_trigger_instrument(6, 70); // Open Hi Hat
-			break;
-		}
+		case MENU_NOTE: {
+			// 1 Halbton pro Schritt, bei gedrücktem Taster eine Oktave
+			midi_instrument_t *map = &midi_instruments[selected_instrument];
+			int16_t note = map->note + direction * (selector_state.held ? 12 : 1);
 
-		case 11: {
-			break;
-		}
+			if(note >= 0 && note <= 127)
+				midi_set_instrument(selected_instrument, map->channel, note);
 
-		case 12: {
-			midi_trigger_instrument(1, 70); // Snare Drum
-			midi_trigger_instrument(2, 70); // Mid-Tom
+			print_selected_instrument();
 			break;
 		}
 
-		case 13: {
+		case MENU_CLOCK: {
+			menu_change_clock(direction);
 			break;
 		}
 
-		case 14: {
-			midi_trigger_instrument(5, 70); // Closed Hi Hat
+		case MENU_TEMPO: {
+			// 0.1 BPM pro Schritt, bei gedrücktem Taster 1 BPM
+			int8_t step = selector_state.held ? 10 : 1;
+			clock_set_tempo(clock_get_tempo() + direction * step);
+			print_tempo();
 			break;
 		}
+	}
+}
 
-		case 15: {
-			break;
-		}
+/**
+ * Event-Handler für das Niederdrücken des Selektorrads
+ *
+ * @see io_selector_set_released_handler
+ */
+void io_selector_pressed(void)
+{
+	selector_state.held = 1;
+	selector_state.turned = 0;
+}
+
+/**
+ * Event-Handler für das Loslassen des Selektorrads nach dem Niederdrücken
+ *
+ * Wurde das Rad nicht gleichzeitig gedreht, wird zur nächsten Menü-Seite
+ * gewechselt.
+ *
+ * @see io_selector_set_pressed_handler
+ */
+void io_selector_released(void)
+{
+	if(!selector_state.turned)
+	{
+		// Geänderte Kanäle und Noten beim Verlassen der Seite sichern
+		if(menu_page == MENU_CHANNEL || menu_page == MENU_NOTE)
+			midi_save_instruments();
+
+		if(++menu_page == N_MENU_PAGES)
+			menu_page = 0;
+
+		print_menu();
 	}
+
+	selector_state.held = 0;
+}
+
+/**
+ * Event-Handler, der aufgerufen wird, wenn das Selektorrad einen Schritt
+ * nach links gedreht wurde
+ *
+ * @see io_selector_set_left_handler
+ */
+void io_selector_left(void)
+{
+	menu_change(-1);
+}
+
+/**
+ * Event-Handler, der aufgerufen wird, wenn das Selektorrad einen Schritt
+ * nach rechts gedreht wurde
+ *
+ * @see io_selector_set_right_handler
+ */
+void io_selector_right(void)
+{
+	menu_change(1);
+}
+
+/**
+ * Event-Handler, der aufgerufen wird, wenn sich ein Parameter geändert hat.
+ * Als Antwort wird eine Midi-CC- oder NRPN-Nachricht gesendet
+ *
+ * @see io_parameter_set_changed_handler
+ */
+void io_parameter_changed(uint8_t parameter, uint16_t value)
+{
+	// Nur vormerken, gesendet wird gedrosselt aus midi_dispatch heraus
+	midi_control_set(parameter, value);
+}
+
+/**
+ * Event-Handler, der aufgerufen wird, wenn eine gewisse Anzahl von
+ * Midi-Clock-Nachrichten registriert wurden.
+ *
+ * Wird aus midi_dispatch heraus im Hauptprogramm aufgerufen
+ *
+ * @see midi_set_clock_interrupt
+ */
+void midi_clock(uint8_t beat)
+{
+	io_sequencer_set(beat);
+
+	// ein vorgemerkter Pattern-Wechsel wird an der Taktgrenze wirksam
+	pattern_step(beat);
+
+	// im Song-Modus den Takt weiterzählen und das nächste Pattern vormerken
+	song_step(beat);
+}
+
+/**
+ * Event-Handler, der bei jedem Tick des Taktgebers aufgerufen wird
+ *
+ * Wird aus midi_dispatch heraus im Hauptprogramm aufgerufen, auf einem Beat
+ * nach midi_clock.
+ *
+ * @see midi_set_tick_handler
+ */
+void midi_tick(void)
+{
+	// Die Instrumente, deren Spur einen Step weiterzählt, mit ihren
+	// Anschlagstärken aus dem Pattern lesen und nach Midi-Kanälen gruppiert
+	// auslösen
+	uint8_t velocity[N_INSTRUMENTS];
+	uint8_t mask = track_tick(velocity);
+
+	if(mask)
+		midi_trigger_instruments(mask, velocity);
 }
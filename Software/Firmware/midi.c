@@ -3,21 +3,46 @@
  * Ansteuerung eines MIDI-Gerätes über den UART-Controller
  */
 
-#include <stdlib.h>
 #include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
 
 #include "bits.h"
+#include "eeprom_queue.h"
 #include "io_config.h"
 #include "midi.h"
+#include "midi_gate.h"
+#include "midi_control.h"
+#include "midi_thru.h"
+#include "midi_sysex.h"
+#include "midi_sense.h"
+#include "pattern.h"
+#include "song.h"
+#include "track.h"
+#include "timer.h"
+#include "clock.h"
+#include "lcd.h"
 
 /**
  * Pointer zum gespeicherten Clock-Interrupt-Callback
  */
-volatile midi_clock_handler clock_callback;
+midi_clock_handler clock_callback;
 
-// TODO: in eine Struct verpacken
+/**
+ * Pointer zum gespeicherten Tick-Callback
+ */
+midi_tick_handler tick_callback;
+
+/**
+ * Zustand des Clock-Zählers
+ *
+ * Wird ausschließlich von midi_dispatch im Hauptprogramm verwendet. Statt eines
+ * einzelnen Clock-Zählers, aus dem Beat und Prescaler-Rest per Division
+ * berechnet werden müssten, werden beide getrennt mitgezählt.
+ */
 typedef struct {
 	// Clock-Interrupt pausiert
 	unsigned paused:1;
@@ -25,28 +50,190 @@ typedef struct {
 	// gespeicherter Clock-Prescaler
 	unsigned prescale:7;
 
-	// Clock-Counter-Reset, abgeletitet von der gewünschten Beats-Zahl
-	uint8_t reset;
+	// Anzahl der Beats, nach denen wieder bei 0 begonnen wird
+	uint8_t beats;
+
+	// Anzahl der Ticks, die bis zum nächsten Beat noch übersprungen werden
+	uint8_t sub;
+
+	// Nummer des nächsten Beats
+	uint8_t beat;
+
+	// Timer1-Zählerstand des letzten Ticks, zum Quantisieren aufgenommener Noten
+	uint16_t tick_time;
+} midi_clock_state_t;
+
+midi_clock_state_t midi_clock_state;
+
+/**
+ * Zustand des Parsers im Empfangs-Interrupt
+ */
+typedef struct {
+	// Status-Byte der laufenden Nachricht bzw. Running-Status,
+	// 0 wenn keiner gültig ist, MIDI_SYSEX_START während einer SysEx-Nachricht
+	uint8_t status;
+
+	// Anzahl der Datenbytes, die zu diesem Status gehören
+	uint8_t length;
+
+	// Anzahl der bereits empfangenen Datenbytes
+	uint8_t count;
+
+	// Daten der Nachricht
+	uint8_t data[2];
+} midi_parser_state_t;
+
+/**
+ * Wird ausschließlich im Empfangs-Interrupt verwendet und muss daher weder
+ * volatile sein noch umkopiert werden.
+ */
+midi_parser_state_t midi_parser_state;
+
+/**
+ * Zähler der Empfangsfehler des UART, je einer pro MIDI_RX_*-Fehlerart
+ */
+uint16_t midi_rx_error_count[N_MIDI_RX_ERRORS];
+
+/**
+ * Ein vom Empfangs-Interrupt dekodiertes Ereignis
+ */
+typedef struct {
+	/// Art des Ereignisses, entspricht dem Status-Byte der Midi-Nachricht
+	uint8_t type;
+
+	/// Datenbytes der Nachricht (bei SPP: LSB, MSB)
+	uint8_t data[2];
+
+	/// Zeitstempel des Empfangs (Timer1)
+	uint16_t timestamp;
+} midi_event_t;
+
+/**
+ * Ereignis-Warteschlange zwischen Empfangs-Interrupt und Hauptprogramm
+ *
+ * Single-Producer/Single-Consumer ohne Sperren: head wird nur mit gesperrten
+ * Interrupts geschrieben (aus Interrupts, die sich auf dem AVR nicht gegenseitig
+ * unterbrechen, oder aus einem ATOMIC_BLOCK), tail nur von midi_dispatch. Da
+ * beide Indizes einzelne Bytes sind, ist jeder Zugriff atomar.
+ */
+struct {
+	/// Wartende Ereignisse
+	midi_event_t events[MIDI_EVENT_QUEUE_SIZE];
+
+	/// Schreib-Index, nur vom Interrupt geschrieben
+	volatile uint8_t head;
+
+	/// Lese-Index, nur von midi_dispatch geschrieben
+	volatile uint8_t tail;
+
+	/// Anzahl der wegen einer vollen Warteschlange verlorenen Ereignisse
+	uint16_t overflows;
+
+	/// Größte gemessene Zeit zwischen Empfang und Verarbeitung in Timer-Ticks
+	uint16_t latency_max;
+} midi_event_queue;
+
+/**
+ * Midi-Kanal, auf dem empfangene Noten aufgenommen werden
+ */
+volatile uint8_t midi_record_channel = MIDI_RECORD_CHANNEL_DEFAULT;
+
+/**
+ * Voreinstellung der Instrumente: alle auf Kanal 1
+ */
+#define MIDI_INSTRUMENTS_DEFAULT { \
+	{0, 36}, /* 0 -> Bass Drum */ \
+	{0, 38}, /* 1 -> Snare Drum */ \
+	{0, 45}, /* 2 -> Mid Tom */ \
+	{0, 37}, /* 3 -> Rimshot */ \
+	{0, 39}, /* 4 -> Hand Clap */ \
+	{0, 42}, /* 5 -> Closed  Hi Hat */ \
+	{0, 46}, /* 6 -> Open  Hi Hat */ \
+	{0, 49}  /* 7 -> Crash Cymbal */ \
+}
+
+/**
+ * Voreinstellung der Instrumente im Flash, für ein leeres EEPROM
+ */
+static const midi_instrument_t midi_instruments_default[N_INSTRUMENTS] PROGMEM = MIDI_INSTRUMENTS_DEFAULT;
 
-	// Zähler der interupt-routine
-	uint8_t clk;
+/**
+ * Gesicherte Konfiguration der Instrumente im EEPROM
+ */
+midi_instrument_t midi_instruments_eeprom[N_INSTRUMENTS] EEMEM = MIDI_INSTRUMENTS_DEFAULT;
 
-	// Auf Daten wartendes Kommando
-	uint8_t last_command;
+/*
+ * Konfiguration der Instrumente
+ */
+midi_instrument_t midi_instruments[N_INSTRUMENTS];
 
-	// Anzahl der fehlenden Bytes
-	uint8_t bytes_required;
+/**
+ * Die Instrumente nach ihrem Midi-Kanal sortiert, damit die Nachrichten eines
+ * Steps kanalweise gesendet werden
+ */
+uint8_t midi_instrument_order[N_INSTRUMENTS];
 
-	// Daten des Kommandos
-	uint8_t data_bytes[3];
-} midi_clock_interrupt_state_t;
+/**
+ * Bitfeld der Midi-Kanäle, auf denen mindestens ein Instrument liegt
+ *
+ * Channel-Nachrichten (z.B. Program Change) werden nur auf diesen Kanälen
+ * empfangen.
+ */
+volatile uint16_t midi_channels;
 
-volatile midi_clock_interrupt_state_t midi_clock_interrupt_state;
+/**
+ * 1, solange die Konfiguration der Instrumente wegen einer vollen
+ * EEPROM-Warteschlange noch gesichert werden muss
+ */
+uint8_t midi_instruments_unsaved;
 
 /**
- * 8-Bit-Feld zum speichern der derzeit aktiven Instrumente
+ * Nach einer Änderung der Instrumente die Reihenfolge nach Midi-Kanälen und
+ * das Bitfeld der Kanäle neu bestimmen
  */
-uint8_t midi_triggered_instruments = 0;
+static void midi_update_instruments(void)
+{
+	uint16_t channels = 0;
+
+	// Sortieren durch Einfügen, Instrumente auf demselben Kanal behalten ihre
+	// Reihenfolge
+	for(uint8_t i = 0; i < N_INSTRUMENTS; i++)
+	{
+		uint8_t channel = midi_instruments[i].channel;
+		uint8_t j = i;
+
+		while(j > 0 && midi_instruments[midi_instrument_order[j - 1]].channel > channel)
+		{
+			midi_instrument_order[j] = midi_instrument_order[j - 1];
+			j--;
+		}
+
+		midi_instrument_order[j] = i;
+		channels |= (uint16_t)1 << channel;
+	}
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		midi_channels = channels;
+	}
+}
+
+/**
+ * Die Konfiguration der Instrumente aus dem EEPROM laden
+ */
+static void midi_load_instruments(void)
+{
+	eeprom_read_block(midi_instruments, midi_instruments_eeprom, sizeof(midi_instruments));
+
+	for(uint8_t i = 0; i < N_INSTRUMENTS; i++)
+	{
+		// Ein ungelöschtes EEPROM liest sich als 0xFF
+		if(midi_instruments[i].channel > 0x0F || midi_instruments[i].note > 0x7F)
+			memcpy_P(&midi_instruments[i], &midi_instruments_default[i], sizeof(midi_instrument_t));
+	}
+
+	midi_update_instruments();
+}
 
 /**
  * Die Midi-Kommunikation initialisieren
@@ -79,7 +266,15 @@ void midi_init(void)
 	SETBITS(UCSRB, BIT(TXEN) | BIT(RXEN));
 
 	// Status nullen
-	memset((void*)&midi_clock_interrupt_state, 0, sizeof(midi_clock_interrupt_state_t));
+	memset(&midi_parser_state, 0, sizeof(midi_parser_state_t));
+	memset(&midi_clock_state, 0, sizeof(midi_clock_state_t));
+	memset((void*)&midi_event_queue, 0, sizeof(midi_event_queue));
+
+	// Sende-Warteschlangen leeren
+	midi_tx_init();
+
+	// Konfiguration der Instrumente laden
+	midi_load_instruments();
 }
 
 /*
@@ -97,22 +292,68 @@ void midi_set_clock_interrupt(midi_clock_handler cb, uint8_t prescale, uint8_t b
 	clock_callback = cb;
 
 	// Den Prescaler speichern
-	midi_clock_interrupt_state.prescale = prescale;
+	midi_clock_state.prescale = prescale;
 
 	// Die Beats-Zahl speichern
-	midi_clock_interrupt_state.reset = prescale * beats;
+	midi_clock_state.beats = beats;
 }
 
-/**
- * Midi-Daten über den UART übermitteln
+/*
+ * Den Tick-Event-Handler setzen
+ */
+void midi_set_tick_handler(midi_tick_handler cb)
+{
+	tick_callback = cb;
+}
+
+/*
+ * Midi-Kanal und Note eines Instruments setzen
+ * siehe Header-Datie für mehr Informationen
  */
-void midi_send(uint8_t data)
+void midi_set_instrument(uint8_t instrument, uint8_t channel, uint8_t note)
 {
-	//  warten bis Senden möglich ist
-	while(BITCLEAR(UCSRA, UDRE));
+	if(instrument >= N_INSTRUMENTS)
+		return;
+
+	midi_instrument_t *map = &midi_instruments[instrument];
+
+	if(map->channel == channel && map->note == note)
+		return;
+
+	// Die klingende Note muss noch auf dem alten Kanal beendet werden
+	if(midi_gate_active(instrument))
+		midi_release_instruments(BIT(instrument));
+
+	map->channel = channel & 0x0F;
+	map->note = note & 0x7F;
 
-	// Daten senden
-	UDR = data;
+	midi_update_instruments();
+}
+
+/*
+ * Die Konfiguration der Instrumente im EEPROM sichern
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_save_instruments(void)
+{
+	// Ist die Warteschlange voll, versucht es midi_dispatch später erneut
+	midi_instruments_unsaved = !eeprom_queue_write(midi_instruments_eeprom, midi_instruments, sizeof(midi_instruments));
+}
+
+/*
+ * Den Aufnahme-Kanal setzen
+ */
+void midi_set_record_channel(uint8_t channel)
+{
+	midi_record_channel = channel;
+}
+
+/*
+ * Der Aufnahme-Kanal
+ */
+uint8_t midi_get_record_channel(void)
+{
+	return midi_record_channel;
 }
 
 /*
@@ -121,11 +362,17 @@ void midi_send(uint8_t data)
  */
 void midi_trigger_instrument(uint8_t instrument, uint8_t velocity)
 {
+	midi_instrument_t *map = &midi_instruments[instrument];
+
+	// Klingt die Note noch, muss sie vor dem erneuten Anschlagen beendet werden
+	if(midi_gate_active(instrument))
+		midi_noteoff(map->channel, map->note);
+
 	// NoteOn-Nachricht senden
-	midi_noteon(midi_instruments[instrument], velocity);
+	midi_noteon(map->channel, map->note, velocity);
 
-	// das entsprechende Bit im Bitfeld setzen
-	SETBIT(midi_triggered_instruments, instrument);
+	// das NoteOff nach Ablauf der Gate-Länge einplanen
+	midi_gate_open(instrument);
 }
 
 
@@ -135,271 +382,672 @@ void midi_trigger_instrument(uint8_t instrument, uint8_t velocity)
  */
 void midi_detrigger_instruments(void)
 {
-	// für alle Instrumente
+	uint8_t mask = 0;
+
+	// Die Instrumente sammeln, deren Gate noch offen ist
 	for(uint8_t instrument = 0; instrument < N_INSTRUMENTS; instrument++)
 	{
-		// Testen, ob das entsprechende Bit gesetzt ist
-		if(BITSET(midi_triggered_instruments, instrument))
+		if(midi_gate_active(instrument))
+			SETBIT(mask, instrument);
+	}
+
+	// und für diese eine NoteOff-Nachricht senden
+	midi_release_instruments(mask);
+}
+
+/*
+ * Mehrere Instrumente gleichzeitig triggern
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_trigger_instruments(uint8_t mask, const uint8_t *velocity)
+{
+	for(uint8_t i = 0; i < N_INSTRUMENTS; i++)
+	{
+		uint8_t instrument = midi_instrument_order[i];
+
+		if(BITSET(mask, instrument))
+			midi_trigger_instrument(instrument, velocity[instrument]);
+	}
+}
+
+/*
+ * Mehrere Instrumente sofort beenden
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_release_instruments(uint8_t mask)
+{
+	for(uint8_t i = 0; i < N_INSTRUMENTS; i++)
+	{
+		uint8_t instrument = midi_instrument_order[i];
+
+		if(BITSET(mask, instrument))
 		{
-			// und sende ggf. eine NoteOff-Nachricht
-			midi_noteoff(midi_instruments[instrument]);
+			midi_gate_close(instrument);
+			midi_noteoff(midi_instruments[instrument].channel, midi_instruments[instrument].note);
 		}
 	}
-
-	// Das Bitfeld leeren
-	midi_triggered_instruments = 0;
 }
 
 /*
  * Ein NoteOn-Kommando senden
  * siehe Header-Datie für mehr Informationen
  */
-void midi_noteon(uint8_t note, uint8_t velocity)
+void midi_noteon(uint8_t channel, uint8_t note, uint8_t velocity)
 {
-	// Midi-Kanal senden
-	midi_send((midi_channel & 0x0F) | MIDI_NOTEON);
+	midi_send_voice((channel & 0x0F) | MIDI_NOTEON, note, velocity);
+}
 
-	// Noten-Wert senden
-	midi_send(note & 0x7F);
+/*
+ * Ein NoteOff-Kommando senden
+ */
+void midi_noteoff(uint8_t channel, uint8_t note)
+{
+#if MIDI_NOTEOFF_AS_NOTEON
+	// NoteOn mit Anschlagstärke 0, teilt sich den Running-Status mit den NoteOns
+	midi_send_voice((channel & 0x0F) | MIDI_NOTEON, note, 0);
+#else
+	midi_send_voice((channel & 0x0F) | MIDI_NOTEOFF, note, 0);
+#endif
+}
 
-	// Anschlagstärke senden
-	midi_send(velocity & 0x7F);
+/*
+ * Eine Midi-Controll-Change-Nachricht senden
+ */
+void midi_cc(uint8_t channel, uint8_t controller, uint8_t value)
+{
+	midi_send_voice((channel & 0x0F) | MIDI_CC, controller, value);
 }
 
+
+/**
+ * Namen einer Oktave, o ist die zweistellige Oktavnummer
+ */
+#define MIDI_NOTENAMES_OCTAVE(o) \
+	"C " o, "C#" o, "D " o, "D#" o, "E " o, "F " o, \
+	"F#" o, "G " o, "G#" o, "A " o, "A#" o, "B " o
+
+/**
+ * Namen aller 128 Midi-Noten im Flash
+ *
+ * Jeder Name ist genau 4 Zeichen lang (kürzere Oktavnummern werden mit einem
+ * Leerzeichen aufgefüllt) und mit einem Null-Byte abgeschlossen.
+ */
+static const char midi_notenames[128][5] PROGMEM = {
+	MIDI_NOTENAMES_OCTAVE("-1"),
+	MIDI_NOTENAMES_OCTAVE("0 "),
+	MIDI_NOTENAMES_OCTAVE("1 "),
+	MIDI_NOTENAMES_OCTAVE("2 "),
+	MIDI_NOTENAMES_OCTAVE("3 "),
+	MIDI_NOTENAMES_OCTAVE("4 "),
+	MIDI_NOTENAMES_OCTAVE("5 "),
+	MIDI_NOTENAMES_OCTAVE("6 "),
+	MIDI_NOTENAMES_OCTAVE("7 "),
+	MIDI_NOTENAMES_OCTAVE("8 "),
+	"C 9 ", "C#9 ", "D 9 ", "D#9 ", "E 9 ", "F 9 ", "F#9 ", "G 9 "
+};
+
 /*
- * Ein NoteOff-Kommando senden
+ * Den Namen einer Note ausgeben
+ * siehe Header-Datie für mehr Informationen
  */
-void midi_noteoff(uint8_t note)
+void midi_print_notename(uint8_t note)
 {
-	// Midi-Kanal senden
-	midi_send((midi_channel & 0x0F) | MIDI_NOTEOFF);
+	lcd_pstring(midi_notenames[note & 0x7F]);
+}
 
-	// Noten-Wert senden
-	midi_send(note & 0x7F);
+/**
+ * Midi 2-Byte-Nachrichten (z.B. Pitch-Wheel oder SongPositionPointer) zusammensetzen
+ */
+uint16_t midi_combine_bytes(uint8_t first, uint8_t second)
+{
+	uint16_t _14bit;
+
+	_14bit = (uint16_t)second;
+	_14bit <<= 7;
+	_14bit |= (uint16_t)first;
 
-	// Anschlagstärke 0 senden
-	midi_send(0);
+	return _14bit;
 }
 
 /*
- * Eine Midi-Controll-Change-Nachricht senden
+ * Ein Ereignis in die Warteschlange legen
+ * siehe Header-Datie für mehr Informationen
  */
-void midi_cc(uint8_t controller, uint8_t value)
+void midi_event_push(uint8_t type, uint8_t data0, uint8_t data1, uint16_t timestamp)
 {
-	// Midi-Kanal senden
-	midi_send((midi_channel & 0x0F) | MIDI_CC);
+	uint8_t head = midi_event_queue.head;
+	uint8_t next = (head + 1) & (MIDI_EVENT_QUEUE_SIZE - 1);
 
-	// Controller-Nummer
-	midi_send(controller & 0x7F);
+	// Warteschlange voll: Ereignis verwerfen und zählen
+	if(next == midi_event_queue.tail)
+	{
+		midi_event_queue.overflows++;
+		return;
+	}
 
-	// Controller-Wert
-	midi_send(value & 0x7F);
-}
+	midi_event_t *event = &midi_event_queue.events[head];
+	event->type = type;
+	event->data[0] = data0;
+	event->data[1] = data1;
+	event->timestamp = timestamp;
 
+	// erst nach dem Befüllen freigeben
+	midi_event_queue.head = next;
+}
 
 /**
- * Den Namen einer Note zusammenbauen
- * Gibt einen Pointer auf einen statischen Speicherbereich zurück, der
- * gültig bleibt, bis die Methode erneut aufgerufen wird.
+ * Anzahl der Datenbytes je Status-Byte
  *
- *  Midi-Note 0  =  C -1
- *            1  =  C#-1
- *            2  =  D -1
- *              ...
- *          125  =  F 9
- *          126  =  F#9
- *          127  =  G 9
- */
-const char* midi_notename(uint8_t note)
+ * Die Einträge 0-6 gelten für die Channel-Voice-Nachrichten 0x80-0xE0 und werden
+ * über das obere Nibble adressiert, die Einträge 8-15 für die System-Common-
+ * Nachrichten 0xF0-0xF7. Realtime-Nachrichten werden vorher abgefangen.
+ */
+static const uint8_t midi_data_bytes[16] PROGMEM = {
+	2, // 0x80 NoteOff
+	2, // 0x90 NoteOn
+	2, // 0xA0 Polyphonic Aftertouch
+	2, // 0xB0 Control Change
+	1, // 0xC0 Program Change
+	1, // 0xD0 Channel Aftertouch
+	2, // 0xE0 Pitch Wheel
+	0, // (nicht belegt)
+
+	0, // 0xF0 SysEx-Start (wird gesondert behandelt)
+	1, // 0xF1 MTC Quarter Frame
+	2, // 0xF2 Song Position Pointer
+	1, // 0xF3 Song Select
+	0, // 0xF4 (undefiniert)
+	0, // 0xF5 (undefiniert)
+	0, // 0xF6 Tune Request
+	0  // 0xF7 SysEx-Ende
+};
+
+/**
+ * Eine vollständig empfangene Nachricht verarbeiten
+ */
+static void midi_process_message(uint8_t status, const uint8_t *data, uint8_t length, uint16_t timestamp)
 {
-	// statischer String-Puffer von 6 Bytes
-	//  3 Bytes für den Notennamen (siehe midi.h)
-	//  2 Bytes für die Oktave (-1 bis 9)
-	//  1 Null-Byte (Stringende)
-	static char notename[6] = "";
+	// Die vollständige Nachricht an den Ausgang weiterleiten
+	midi_thru_forward(status, data, length, timestamp);
 
-	// Index der Basisnote (C-B ? 0-11)
-	uint8_t basenote = note % 12;
+	if(status < 0xF0)
+	{
+		uint8_t channel = status & 0x0F;
+		status &= 0xF0;
 
-	// Name der Note aus dem Namen-Array kopieren
-	strcpy(notename, midi_notenames[basenote]);
+		// NoteOns auf dem Aufnahme-Kanal werden mit ihrem Zeitstempel an das
+		// Hauptprogramm übergeben, quantisiert wird erst dort
+		if(status == MIDI_NOTEON && data[1] != 0 && channel == midi_record_channel)
+		{
+			midi_event_push(MIDI_NOTEON, data[0], data[1], timestamp);
+			return;
+		}
 
-	// Postfix der Note (-1 bis 9)
-	int8_t postfix = (note / 12) - 1;
+		// Channel-Nachrichten auf Kanälen ohne Instrument sind nicht für uns bestimmt
+		if(!(midi_channels & ((uint16_t)1 << channel)))
+			return;
+	}
+
+	switch(status)
+	{
+		// eine SPP-Nachricht, LSB und MSB weiterreichen
+		case MIDI_SONG_POSITION_POINTER: {
+			midi_event_push(MIDI_SONG_POSITION_POINTER, data[0], data[1], timestamp);
+			break;
+		}
 
-	// Postix in einen String umwandeln
-	char postfix_str[3] = "";
-	itoa(postfix, postfix_str, 10);
+		// Song Select wählt das nächste Pattern
+		case MIDI_SONG_SELECT: {
+			midi_event_push(MIDI_SONG_SELECT, data[0], 0, timestamp);
+			break;
+		}
 
-	// an den Notennamen anhängen
-	strcat(notename, postfix_str);
+		// Program Change auf dem eigenen Kanal ebenso
+		case MIDI_PROGRAM_CHANGE: {
+			midi_event_push(MIDI_PROGRAM_CHANGE, data[0], 0, timestamp);
+			break;
+		}
 
-	// Pointer auf statisches Array zurückgeben
-	return notename;
+		// Alle anderen Nachrichten werden korrekt überlesen, aber (noch) nicht
+		// ausgewertet
+	}
 }
 
 /**
- * Midi 2-Byte-Nachrichten (z.B. Pitch-Wheel oder SongPositionPointer) zusammensetzen
+ * Ein Status-Byte (0x80-0xF7) verarbeiten
  */
-uint16_t midi_combine_bytes(uint8_t first, uint8_t second)
+static void midi_process_status(uint8_t input, midi_parser_state_t *state, uint16_t timestamp)
 {
-	uint16_t _14bit;
+	// Anzahl der Datenbytes aus der Tabelle lesen
+	uint8_t index = (input < 0xF0) ? ((input >> 4) & 0x07) : (0x08 | (input & 0x07));
+	uint8_t length = pgm_read_byte(&midi_data_bytes[index]);
 
-	_14bit = (uint16_t)second;
-	_14bit <<= 7;
-	_14bit |= (uint16_t)first;
+	// Jedes Status-Byte beendet eine laufende SysEx-Nachricht, regulär aber
+	// nur das SysEx-Ende
+	if(state->status == MIDI_SYSEX_START)
+		midi_sysex_receive_end(input == MIDI_SYSEX_END);
 
-	return _14bit;
+	state->count = 0;
+	state->length = length;
+
+	if(input == MIDI_SYSEX_START)
+	{
+		// SysEx-Daten bis zum Ende-Byte an das SysEx-Modul übergeben
+		state->status = MIDI_SYSEX_START;
+		midi_sysex_receive_start();
+	}
+	else if(length == 0)
+	{
+		// Nachrichten ohne Datenbytes (Tune Request, SysEx-Ende, undefinierte)
+		// sind sofort vollständig und heben den Running-Status auf
+		state->status = 0;
+		midi_process_message(input, state->data, 0, timestamp);
+	}
+	else
+	{
+		// Auf die Datenbytes warten
+		state->status = input;
+	}
 }
 
-uint8_t midi_process_realtime(uint8_t input, midi_clock_interrupt_state_t *state)
+/**
+ * Ein Datenbyte (0x00-0x7F) verarbeiten
+ */
+static void midi_process_data(uint8_t input, midi_parser_state_t *state, uint16_t timestamp)
 {
-	switch(input)
+	// SysEx-Daten werden byteweise weitergereicht
+	if(state->status == MIDI_SYSEX_START)
 	{
-		// Eine Clock-Nachricht
-		case MIDI_CLOCK: {
+		midi_sysex_receive(input);
+		return;
+	}
+
+	// Kein gültiger Status: Byte überlesen
+	if(state->status == 0)
+		return;
+
+	state->data[state->count++] = input;
+
+	// Nachricht noch nicht vollständig
+	if(state->count < state->length)
+		return;
+
+	midi_process_message(state->status, state->data, state->length, timestamp);
+
+	// Channel-Nachrichten bleiben als Running-Status erhalten,
+	// System-Common-Nachrichten nicht
+	state->count = 0;
+	if(state->status >= 0xF0)
+		state->status = 0;
+}
+
+/**
+ * Eine empfangene Note in das laufende Pattern aufnehmen
+ *
+ * Die Note wird über midi_instruments einem Instrument zugeordnet und auf den
+ * nächstgelegenen Step der Spur dieses Instruments quantisiert, die eine
+ * eigene Länge und ein eigenes Tempo haben kann (siehe track.h). Die Position
+ * zwischen zwei Steps ergibt sich aus den Ticks bis zum nächsten Step der
+ * Spur, verfeinert um den Abstand des Zeitstempels zum letzten Tick. Da die
+ * Warteschlange die Ereignisse in Empfangsreihenfolge liefert, sind die
+ * Spuren beim Verarbeiten der Note auf dem Stand ihres Empfangs.
+ */
+static void midi_record(const midi_event_t *event)
+{
+	midi_clock_state_t *state = &midi_clock_state;
+
+	if(state->paused)
+		return;
+
+	uint8_t instrument;
+	for(instrument = 0; instrument < N_INSTRUMENTS; instrument++)
+	{
+		if(midi_instruments[instrument].note == event->data[0])
+			break;
+	}
+
+	if(instrument == N_INSTRUMENTS)
+		return;
+
+	// Liegt die Note in der zweiten Hälfte des letzten Ticks?
+	uint8_t late = (uint16_t)(event->timestamp - state->tick_time) >= clock_tick_interval() / 2;
+
+	pattern_record(instrument, track_quantize(instrument, late), event->data[1]);
+}
+
+/**
+ * Ein Ereignis aus der Warteschlange verarbeiten
+ */
+static void midi_dispatch_event(const midi_event_t *event)
+{
+	midi_clock_state_t *state = &midi_clock_state;
+
+	// Realtime-Ereignisse der gerade nicht aktiven Clock-Quelle ignorieren
+	if(event->type >= 0xF8 && event->data[0] != clock_get_source())
+		return;
+
+	switch(event->type)
+	{
+		// Ein Tick des Taktgebers (CLOCK_TICKS_PER_CLOCK pro Midi-Clock)
+		case CLOCK_TICK: {
 			if(state->paused)
-				return 1;
+				return;
 
-			// Wenn der Prescaler erreicht wurde
-			if(state->clk % state->prescale == 0)
-			{
-				// den Event-Handler auslösen, dabei den passenden Beat ausrechnen
-				if(clock_callback)
-					clock_callback(state->clk / state->prescale);
-			}
+			state->tick_time = event->timestamp;
+
+			// Wenn der Prescaler erreicht wurde, den Event-Handler auslösen
+			uint8_t beat = (state->sub == 0);
+			if(beat && clock_callback)
+				clock_callback(state->beat);
 
-			// Den Clock-Zähler erhöhen, dabei prüfen ob die max. Beat-Zahl erreicht wurde
-			if(++state->clk == state->reset)
+			// Der Tick-Event-Handler läuft bei jedem Tick, nach dem eines Beats
+			if(tick_callback)
+				tick_callback();
+
+			if(beat)
 			{
-				// Den Clock-Zähler zurück setzen
-				state->clk = 0;
+				// nach den Triggern des Steps darf ein SysEx-Stück folgen
+				midi_sysex_step();
+
+				// Den Beat-Zähler erhöhen, dabei prüfen ob die max. Beat-Zahl erreicht wurde
+				if(++state->beat == state->beats)
+					state->beat = 0;
+
+				// Den Prescaler neu laden
+				state->sub = state->prescale * CLOCK_TICKS_PER_CLOCK;
 			}
-			return 1;
+
+			state->sub--;
+			return;
+		}
+
+		// Eine empfangene Clock-Nachricht führt die PLL des Taktgebers nach,
+		// die daraus die Ticks erzeugt
+		case MIDI_CLOCK: {
+			clock_follow(event->timestamp);
+			return;
 		}
 
 		// Eine MIDI-Start-Nachricht setzt den Clock-Zähler auf 0 zurück
 		// und aktiviert den Clock-Zähler
 		case MIDI_START: {
 			// Den Clock-Zähler auf 0 zurück fahren
-			state->clk = 0;
+			state->sub = 0;
+			state->beat = 0;
 			state->paused = 0;
-			return 1;
+
+			// Ein Song und alle Spuren beginnen von vorn
+			song_locate(0, 0);
+			track_locate(0);
+
+			// Die PLL auf die nächste Clock einrasten lassen
+			if(event->data[0] == CLOCK_SOURCE_EXTERNAL)
+				clock_relock();
+			return;
 		}
 
 		// Eine MIDI-Stop-Nachricht stoppt den Clock-Zähler
 		case MIDI_STOP: {
 			state->paused = 1;
-			return 1;
+
+			// Die PLL hält den Tick-Generator an
+			if(event->data[0] == CLOCK_SOURCE_EXTERNAL)
+				clock_relock();
+			return;
 		}
 
 		// Eine MIDI-Ĉontinue-Nachricht aktiviert den Clock-Zähler
 		case MIDI_CONTINUE: {
 			state->paused = 0;
-			return 1;
-		}
-	}
 
-	// Dies war keine Realtime-Nachricht
-	return 0;
-}
+			if(event->data[0] == CLOCK_SOURCE_EXTERNAL)
+				clock_relock();
+			return;
+		}
 
+		// Eine Note vom Aufnahme-Kanal
+		case MIDI_NOTEON: {
+			midi_record(event);
+			return;
+		}
 
+		// Ein Pattern-Wechsel, wirksam ab der nächsten Taktgrenze
+		case MIDI_SONG_SELECT:
+		case MIDI_PROGRAM_CHANGE: {
+			pattern_select(event->data[0]);
+			return;
+		}
 
-uint8_t midi_process_data(uint8_t input, midi_clock_interrupt_state_t *state)
-{
-	// eine wartende Nachricht
-	if(state->last_command > 0)
-	{
-		// Ein weiteres Byte dieser Nachricht empfangen
-		state->data_bytes[state->bytes_required] = input;
+		// Eine vom Empfangs-Interrupt geprüfte SysEx-Nachricht
+		case MIDI_SYSEX_START: {
+			midi_sysex_dispatch(event->data[0]);
+			return;
+		}
 
-		// Alle benötigten Bytes für diese Nachricht wurden empfangen
-		if(state->bytes_required == 0)
-		{
-			// Empfangene Nachricht verarbeiten
-			switch(state->last_command)
+		// eine SPP-Nachricht
+		case MIDI_SONG_POSITION_POINTER: {
+			// Als Master bestimmen wir die Position selbst
+			if(clock_get_source() != CLOCK_SOURCE_EXTERNAL)
+				return;
+
+			// Die nächste Clock ist die erste an der neuen Position
+			clock_relock();
+
+			// empfangene Bytes zu Midi-Beats zusammenführen
+			uint16_t spp = midi_combine_bytes(event->data[0], event->data[1]);
+
+			// jeder Midi-Beat entspricht 6 Clock-Cycles,
+			// welche dann in Takte und die Position im Takt zerlegt werden.
+			// SPP ist selten, hier darf dividiert werden.
+			uint16_t length = (uint16_t)state->prescale * state->beats;
+			uint32_t clocks = (uint32_t)spp * 6;
+			uint16_t bar = clocks / length;
+			uint16_t clk = clocks % length;
+			uint8_t rest = clk % state->prescale;
+
+			state->beat = clk / state->prescale;
+			state->sub = 0;
+
+			// Mitten in einem Beat: der nächste Beat-Aufruf kommt erst nach dem Rest
+			if(rest)
 			{
-				// eine SPP-Nachricht
-				case MIDI_SONG_POSITION_POINTER: {
-					// empfangene Bytes zu Midi-Beats zusammenführen
-					uint16_t spp = midi_combine_bytes(state->data_bytes[1], state->data_bytes[0]);
-
-					// jeder Midi-Beat entspricht 6 Clock-Cycles,
-					// welche dann auf die Länge des internen Sequenzers umgelegt wird
-					state->clk = (spp * 6) % state->reset;
+				state->sub = (state->prescale - rest) * CLOCK_TICKS_PER_CLOCK;
+				if(++state->beat == state->beats)
+				{
+					state->beat = 0;
+					bar++;
 				}
 			}
 
-			// wartendes Kommando wurde abgearbeitet
-			state->last_command = 0;
-		}
-
-		// sonst die Anzahl der benötigten Bytes reduzieren
-		else state->bytes_required--;
+			// Im Song-Modus auch den Eintrag und das Pattern des Taktes bestimmen
+			song_locate(bar, state->beat);
 
-		// Es wurde ein Datenbyte verarbeitet
-		return 1;
+			// Jede Spur zählt mit ihrer eigenen Länge und ihrem Tempo
+			track_locate(clocks * CLOCK_TICKS_PER_CLOCK);
+			return;
+		}
 	}
+}
+
+/**
+ * Den Parser nach einem Empfangsfehler neu synchronisieren
+ *
+ * Die laufende Nachricht und der Running-Status werden verworfen, bis zum
+ * nächsten Status-Byte werden alle Datenbytes überlesen.
+ */
+static void midi_parser_resync(midi_parser_state_t *state)
+{
+	if(state->status == MIDI_SYSEX_START)
+		midi_sysex_receive_end(0);
 
-	// Keine wartetende Nachricht
-	return 0;
+	state->status = 0;
+	state->count = 0;
 }
 
+/**
+ * Die Fehler-Flags aus UCSRA zählen
+ */
+static void midi_rx_error(uint8_t flags)
+{
+	if(flags & BIT(FE))
+		midi_rx_error_count[MIDI_RX_FRAMING]++;
 
-uint8_t midi_process_message(uint8_t input, midi_clock_interrupt_state_t *state)
+	if(flags & BIT(DOR))
+		midi_rx_error_count[MIDI_RX_OVERRUN]++;
+
+	if(flags & BIT(PE))
+		midi_rx_error_count[MIDI_RX_PARITY]++;
+}
+
+/*
+ * Empfangene Midi-Ereignisse verarbeiten
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_dispatch(void)
 {
-	// Nachricht auswerten
-	switch(input)
+	while(midi_event_queue.tail != midi_event_queue.head)
 	{
-		case MIDI_SONG_POSITION_POINTER: {
-			state->last_command = MIDI_SONG_POSITION_POINTER;
-			state->bytes_required = 1; // 2 Bytes
+		// Ereignis kopieren und den Platz in der Warteschlange freigeben
+		uint8_t tail = midi_event_queue.tail;
+		midi_event_t event = midi_event_queue.events[tail];
+		midi_event_queue.tail = (tail + 1) & (MIDI_EVENT_QUEUE_SIZE - 1);
 
-			return 1;
-		}
+		// Zeit zwischen Empfang und Verarbeitung messen
+		uint16_t latency = timer_now() - event.timestamp;
+		if(latency > midi_event_queue.latency_max)
+			midi_event_queue.latency_max = latency;
 
-#if 0
-		case MIDI_SONG_SELECT: {
-			// select saved pattern via Callback
-			state->clk = 0;
-			return 1;
+		midi_dispatch_event(&event);
+	}
+
+	// Ausgebliebenes Active Sensing oder eine ausgebliebene externe Clock
+	uint8_t expect_clock = !midi_clock_state.paused && clock_get_source() == CLOCK_SOURCE_EXTERNAL;
+	uint8_t lost = midi_sense_poll(expect_clock);
+
+	if(lost)
+	{
+		// keine Note darf ohne Gegenstelle hängen bleiben
+		midi_detrigger_instruments();
+
+		// Ohne Clock auf den ersten Step zurück und neu einrasten, ein Song
+		// und alle Spuren beginnen wie bei Start von vorn
+		if(lost & MIDI_SENSE_LOST_CLOCK)
+		{
+			midi_clock_state.sub = 0;
+			midi_clock_state.beat = 0;
+			song_locate(0, 0);
+			track_locate(0);
+			clock_relock();
 		}
-#endif
 	}
 
-	// Keine verarbeitete Nachricht
-	return 0;
+	// Erst nach den NoteOns der Steps die abgelaufenen Gates schließen
+	midi_gate_poll();
+
+	// Control-Changes kommen zuletzt und nur, wenn keine Noten warten
+	midi_control_drain();
+
+	// Einen laufenden SysEx-Dump weitersenden
+	midi_sysex_poll(midi_clock_state.paused);
+
+	// Eine zurückgestellte Sicherung der Instrumente wiederholen
+	if(midi_instruments_unsaved)
+		midi_save_instruments();
 }
 
+/*
+ * Anzahl der verlorenen Ereignisse
+ */
+uint16_t midi_event_overflows(void)
+{
+	uint16_t overflows;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		overflows = midi_event_queue.overflows;
+	}
+
+	return overflows;
+}
 
+/*
+ * Größte gemessene Verarbeitungs-Latenz
+ */
+uint16_t midi_event_latency_max(void)
+{
+	return midi_event_queue.latency_max;
+}
 
+/*
+ * Anzahl der Empfangsfehler einer Fehlerart
+ */
+uint16_t midi_rx_errors(uint8_t type)
+{
+	uint16_t count;
 
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		count = midi_rx_error_count[type];
+	}
 
+	return count;
+}
 
 /**
  * UART Empfangs-Interrupt
  */
 ISR(USART_RXC_vect)
 {
+	// Die Fehler-Flags gehören zum Byte im Puffer und müssen vor UDR gelesen werden
+	uint8_t errors = UCSRA & (BIT(FE) | BIT(DOR) | BIT(PE));
+
 	// anliegende Nachricht aus dem Puffer lesen
 	uint8_t input = UDR;
 
-	// State aus dem RAM lesen
-	midi_clock_interrupt_state_t state = midi_clock_interrupt_state;
+	// Zeitpunkt des Empfangs festhalten
+	uint16_t timestamp = TCNT1;
+
+	if(errors)
+	{
+		midi_rx_error(errors);
 
+		// Vor diesem Byte ging etwas verloren oder es ist selbst unbrauchbar:
+		// die laufende Nachricht ist nicht mehr vollständig
+		midi_parser_resync(&midi_parser_state);
 
-	// Realtime-Nachrichten verarbeiten (können zu jedem Zeitpunkt auftreten)
-	if(!midi_process_realtime(input, &state))
+		// Nach einem Framing- oder Paritätsfehler ist das Byte selbst ungültig,
+		// nach einem Überlauf dagegen korrekt empfangen
+		if(errors & (BIT(FE) | BIT(PE)))
+			return;
+	}
+
+	// Für die Überwachung von Verbindung und Clock vermerken
+	midi_sense_receive(input);
+
+	// Schneller Pfad für Realtime-Nachrichten (0xF8-0xFF): sie können zu jedem
+	// Zeitpunkt auftreten, auch mitten in anderen Nachrichten, und lassen den
+	// Parser-Zustand unberührt. Bei 24 Clocks pro Viertel machen sie den größten
+	// Teil der empfangenen Bytes aus.
+	if(input >= 0xF8)
 	{
-		// Daten von Mehrteil-Nachrichten verarbeiten
-		if(!midi_process_data(input, &state))
+		// Realtime-Bytes ohne Umweg über das Hauptprogramm weiterleiten
+		midi_thru_forward(input, 0, 0, timestamp);
+
+		switch(input)
 		{
-			// Kommando-Nachrichten verarbeiten
-			midi_process_message(input, &state);
+			// Clock-, Start-, Stop- und Continue-Nachrichten werden im Hauptprogramm verarbeitet
+			case MIDI_CLOCK:
+			case MIDI_START:
+			case MIDI_STOP:
+			case MIDI_CONTINUE:
+				midi_event_push(input, CLOCK_SOURCE_EXTERNAL, 0, timestamp);
 		}
+		return;
 	}
 
-	// State zurück in den RAM schreiben
-	 midi_clock_interrupt_state = state;
+	// Status-Bytes starten eine neue Nachricht, alle anderen sind Datenbytes
+	if(input & 0x80)
+		midi_process_status(input, &midi_parser_state, timestamp);
+	else
+		midi_process_data(input, &midi_parser_state, timestamp);
 }
@@ -6,11 +6,42 @@
 #ifndef MIDI_H_
 #define MIDI_H_
 
+#include <stdint.h>
+
+#include "io_config.h"
+#include "midi_tx.h"
+
 /**
  * Baudrate der MIDI-Kommunikation
  */
 #define MIDI_BAUD 31250UL
 
+/**
+ * Anzahl der Plätze in der Ereignis-Warteschlange zwischen Empfangs-Interrupt
+ * und Hauptprogramm
+ *
+ * Muss eine Zweierpotenz sein. Ein Platz bleibt immer frei.
+ */
+#ifndef MIDI_EVENT_QUEUE_SIZE
+#define MIDI_EVENT_QUEUE_SIZE 16
+#endif
+
+#if (MIDI_EVENT_QUEUE_SIZE & (MIDI_EVENT_QUEUE_SIZE - 1)) || MIDI_EVENT_QUEUE_SIZE > 128
+#error "MIDI_EVENT_QUEUE_SIZE muss eine Zweierpotenz <= 128 sein"
+#endif
+
+/**
+ * NoteOff als NoteOn mit Anschlagstärke 0 senden
+ *
+ * Beide Varianten sind laut Midi-Spezifikation gleichwertig. Wird NoteOff als
+ * NoteOn gesendet, teilen sich die NoteOffs eines Steps und die darauf folgenden
+ * NoteOns ein einziges Status-Byte (Running-Status), was auf der Leitung etwa ein
+ * Drittel der Bytes spart.
+ */
+#ifndef MIDI_NOTEOFF_AS_NOTEON
+#define MIDI_NOTEOFF_AS_NOTEON 1
+#endif
+
 /**
  * Die Midi-Start-Nachricht
  *
@@ -45,6 +76,23 @@
  */
 #define MIDI_SONG_POSITION_POINTER 0xF2
 
+/**
+ * Midi-Song-Select-Nachricht
+ *
+ * wählt einen Song bzw. ein Pattern aus
+ */
+#define MIDI_SONG_SELECT 0xF3
+
+/**
+ * Beginn einer System-Exclusive-Nachricht
+ */
+#define MIDI_SYSEX_START 0xF0
+
+/**
+ * Ende einer System-Exclusive-Nachricht
+ */
+#define MIDI_SYSEX_END 0xF7
+
 /**
  * Eine Midi-NoteOn-Nachricht
  *
@@ -54,11 +102,12 @@
  * Abstand zwischen NoteOn und NoteOff darf nicht zu klein sein, damit der Synthesizer
  * genug Zeit hat, den Klang zu produzieren.
  *
- * Das Instrument-Trigger-System sorgt dafür, dass jede Note genau 1/16 aktiv ist und
- * vor dem senden des nächsten NoteOn wieder ausgeschaltet wird.
+ * Das Instrument-Trigger-System sorgt dafür, dass jede Note für die eingestellte
+ * Gate-Länge aktiv ist und spätestens vor dem senden des nächsten NoteOn wieder
+ * ausgeschaltet wird.
  *
  * @see midi_trigger_instrument
- * @see midi_detrigger_instruments
+ * @see midi_gate.h
  */
 #define MIDI_NOTEON 0x90
 
@@ -76,36 +125,70 @@
 #define MIDI_CC 0xB0
 
 /**
- * Benennung der 12 Noten der 12-Ton-Musik
+ * Eine Midi-ProgramChange-Nachricht
+ */
+#define MIDI_PROGRAM_CHANGE 0xC0
+
+
+/**
+ * Aufnahme-Kanal nach dem Einschalten (0-basiert, 9 entspricht dem
+ * üblichen Drum-Kanal 10)
+ */
+#define MIDI_RECORD_CHANNEL_DEFAULT 9
+
+/**
+ * Aufnahme-Kanal: keine Aufnahme
  */
-static const char* const midi_notenames[] = {"C ", "C#", "D ", "D#", "E ", "F ", "F#", "G ", "G#", "A ", "A#", "B "};
+#define MIDI_RECORD_OFF 0xFF
 
 /**
- * Konfiguration des Midi-Kanals
- * @todo Über's Menü Konfigurierbar machen
+ * Zuordnung eines Instruments zu einem Midi-Kanal und einer Note
  */
-static const uint8_t midi_channel = 0;
+typedef struct {
+	/// Midi-Kanal (0-15)
+	uint8_t channel;
+
+	/// Midi-Note (0-127)
+	uint8_t note;
+} midi_instrument_t;
 
 /**
- * Konfiguration der Instrumente
- * @todo Über's Menü Konfigurierbar machen
+ * Konfiguration der Instrumente: Midi-Kanal und Note pro Instrument
+ *
+ * Liegt im EEPROM und wird von midi_init in den RAM geladen. Geändert wird sie
+ * nur über midi_set_instrument (aus dem Menü oder per SysEx), gesichert mit
+ * midi_save_instruments.
+ *
+ * @see midi_sysex.h
  */
-static const uint8_t midi_instruments[8] = {
-	36, // 0 -> Bass Drum
-	38, // 1 -> Snare Drum
-	45, // 2 -> Mid Tom
-	37, // 3 -> Rimshot
-	39, // 4 -> Hand Clap
-	42, // 5 -> Closed  Hi Hat
-	46, // 6 -> Open  Hi Hat
-	49  // 7 -> Crash Cymbal
-};
+extern midi_instrument_t midi_instruments[N_INSTRUMENTS];
 
 /**
  * Die Midi-Kommunikation initialisieren
+ *
+ * Lädt auch die Konfiguration der Instrumente aus dem EEPROM. Ungültige
+ * Einträge (z.B. bei einem leeren EEPROM) werden durch die Voreinstellung
+ * ersetzt.
  */
 void midi_init(void);
 
+/**
+ * Midi-Kanal (0-15) und Note (0-127) eines Instruments setzen
+ *
+ * Wird nur im RAM geändert, bis midi_save_instruments aufgerufen wird. Eine
+ * noch klingende Note des Instruments wird vorher beendet.
+ */
+void midi_set_instrument(uint8_t instrument, uint8_t channel, uint8_t note);
+
+/**
+ * Die Konfiguration der Instrumente im EEPROM sichern
+ *
+ * Es werden nur die geänderten Bytes geschrieben, und zwar im Hintergrund
+ * (siehe eeprom_queue.h). Ist die Warteschlange voll, wird der Auftrag von
+ * midi_dispatch wiederholt, sobald wieder Platz ist.
+ */
+void midi_save_instruments(void);
+
 /**
  * Definition eines Clock-Event-Handlers
  */
@@ -122,7 +205,9 @@ typedef void (*midi_clock_handler)(uint8_t beat);
  *
  * Vom Midi-Host werden 96 Midi-Clocks per Takt gesendet. Wenn also ein
  * Clock-Vorteiler von 6 angegeben ist, wird der midi_clock Event-Handler
- * 16 mal pro Takt aufgerufen, also zu jeder 16tel Note.
+ * 16 mal pro Takt aufgerufen, also zu jeder 16tel Note. Intern wird mit den
+ * vierfach aufgelösten Ticks des Taktgebers gezählt (siehe clock.h), der
+ * Vorteiler darf darum höchstens 63 sein.
  *
  * Was zu einem jeweiligen Aufruf des Event-Handlers geschehen soll, muss
  * ebenfalls mit den Midi-Clocks synchronisiert sein, da der Midi-Host zu jedem
@@ -137,39 +222,163 @@ typedef void (*midi_clock_handler)(uint8_t beat);
  * kann hier aber auch eine kleinere Zahl angegeben werden, z.B. 8. Der
  * beat-Parameter des Callbacks zählt dann z.B. nur von 0-7, bevor er wieder mit
  * 0 beginnt.
+ *
+ * Der Empfangs-Interrupt legt Clock-Nachrichten nur mit einem Zeitstempel in
+ * eine Warteschlange. Daraus erzeugt der Taktgeber gleichmäßige Ticks,
+ * aufgerufen wird der Event-Handler aus midi_dispatch heraus, also im
+ * Hauptprogramm und mit aktivierten Interrupts.
+ *
+ * @see midi_dispatch
  */
 void midi_set_clock_interrupt(midi_clock_handler, uint8_t prescale, uint8_t beats);
 
+/**
+ * Definition eines Tick-Event-Handlers
+ */
+typedef void (*midi_tick_handler)(void);
+
+/**
+ * Den Tick-Event-Handler setzen
+ *
+ * Wird bei laufender Clock für jeden Tick des Taktgebers (CLOCK_TICKS_PER_CLOCK
+ * pro Midi-Clock) aus midi_dispatch heraus aufgerufen, fällt der Tick auf einen
+ * Beat, nach dem Clock-Event-Handler.
+ */
+void midi_set_tick_handler(midi_tick_handler);
+
+/**
+ * Empfangene Midi-Ereignisse verarbeiten
+ *
+ * Arbeitet die Ereignis-Warteschlange ab, die vom Empfangs-Interrupt befüllt
+ * wird, und ruft ggf. den Clock-Event-Handler auf. Muss regelmäßig aus dem
+ * Hauptprogramm heraus aufgerufen werden, die Zeit zwischen zwei Aufrufen geht
+ * direkt in die Latenz der Trigger ein.
+ */
+void midi_dispatch(void);
+
+/**
+ * Ein Ereignis in die Warteschlange von midi_dispatch legen
+ *
+ * type entspricht dem Status-Byte der Midi-Nachricht. Bei Realtime-Ereignissen
+ * (Clock, Start, Stop, Continue) gibt data0 die Quelle an (siehe clock.h), bei
+ * anderen Nachrichten enthalten data0 und data1 die Datenbytes. timestamp ist
+ * der Timer1-Zählerstand, zu dem das Ereignis aufgetreten ist.
+ *
+ * Die Warteschlange hat nur einen Erzeuger, darum darf diese Funktion nur mit
+ * gesperrten Interrupts aufgerufen werden, also aus Interrupts heraus oder
+ * innerhalb eines ATOMIC_BLOCK.
+ */
+void midi_event_push(uint8_t type, uint8_t data0, uint8_t data1, uint16_t timestamp);
+
+/**
+ * Anzahl der Ereignisse, die wegen einer vollen Warteschlange verloren gingen
+ */
+uint16_t midi_event_overflows(void);
+
+/**
+ * Empfangsfehler: Stop-Bit fehlt (z.B. Störung oder falsche Baudrate)
+ */
+#define MIDI_RX_FRAMING 0
+
+/**
+ * Empfangsfehler: ein Byte ging verloren, weil der Empfangs-Interrupt zu spät kam
+ */
+#define MIDI_RX_OVERRUN 1
+
+/**
+ * Empfangsfehler: Paritätsfehler (nur bei eingeschalteter Parität möglich)
+ */
+#define MIDI_RX_PARITY 2
+
+/**
+ * Anzahl der Fehlerarten
+ */
+#define N_MIDI_RX_ERRORS 3
+
+/**
+ * Anzahl der Empfangsfehler einer Fehlerart (MIDI_RX_*)
+ *
+ * Nach jedem Fehler verwirft der Parser die laufende Nachricht und wartet auf
+ * das nächste Status-Byte. Ein Byte mit Framing- oder Paritätsfehler wird
+ * verworfen, nach einem Überlauf wird das empfangene Byte normal verarbeitet.
+ */
+uint16_t midi_rx_errors(uint8_t type);
+
+/**
+ * Größte gemessene Zeit zwischen dem Empfang eines Ereignisses und seiner
+ * Verarbeitung in midi_dispatch, in Timer-Ticks
+ *
+ * @see TIMER_TICKS_PER_MS
+ */
+uint16_t midi_event_latency_max(void);
+
+/**
+ * Den Midi-Kanal setzen, auf dem empfangene Noten aufgenommen werden
+ *
+ * NoteOns auf diesem Kanal, deren Note einem Instrument zugeordnet ist, werden
+ * auf den nächstgelegenen Step quantisiert in das laufende Pattern
+ * eingetragen. MIDI_RECORD_OFF schaltet die Aufnahme ab.
+ *
+ * @see pattern_record
+ */
+void midi_set_record_channel(uint8_t channel);
+
+/**
+ * Der Aufnahme-Kanal oder MIDI_RECORD_OFF
+ */
+uint8_t midi_get_record_channel(void);
+
 /**
  * Ein Instrument triggern
  *
- * Versendet eine Midi-NoteOn-Nachricht für das gegebene Instrument (0-7)
- * eine Midi-NoteOn-Nachricht versenden und speichert im midi_triggered_instruments-Bitfeld,
- * dass das Instrument grade aktiv ist.
+ * Versendet eine Midi-NoteOn-Nachricht für das gegebene Instrument (0-7) und öffnet
+ * dessen Gate. Klingt die Note des Instruments noch, wird vorher ein NoteOff gesendet.
  *
- * Welche Midi-Note hinter dem Instrument steht, wird aus dem midi_instruments-Array abgeleitet.
+ * Welcher Midi-Kanal und welche Note hinter dem Instrument stehen, wird aus dem
+ * midi_instruments-Array abgeleitet.
  *
- * Im Zusammenhang mit midi_detrigger_instruments wird sichergestellt, dass eine Note für einen
- * geeignet langen Zeitraum aktiv bleibt, ohne das Hauptprogramm mit delay-Schleifen zu bremsen.
+ * Das Gate sorgt dafür, dass die Note nach der eingestellten Gate-Länge wieder
+ * abgeschaltet wird, ohne das Hauptprogramm mit delay-Schleifen zu bremsen.
  *
  * @see midi_noteon
- * @see midi_triggered_instruments
  * @see midi_instruments
- * @see midi_detrigger_instruments
+ * @see midi_gate_open
  */
 void midi_trigger_instrument(uint8_t instrument, uint8_t velocity);
 
 /**
  * Alle zuvor aktiven Instrumente deaktivieren
  *
- * Für die Instrumente, für die im midi_triggered_instruments-Bitfeld ein Bit gesetzt ist
- * wird eine NoteOff-Nachricht gesendet.
+ * Für die Instrumente, deren Gate noch offen ist, wird sofort eine NoteOff-Nachricht
+ * gesendet, ohne den Ablauf der Gate-Länge abzuwarten.
  *
  * @see midi_noteoff
- * @see midi_triggered_instruments
+ * @see midi_gate_active
  */
 void midi_detrigger_instruments(void);
 
+/**
+ * Mehrere Instrumente gleichzeitig triggern
+ *
+ * mask enthält ein Bit pro Instrument, velocity die Anschlagstärken aller
+ * N_INSTRUMENTS Instrumente. Die Instrumente werden nach ihrem
+ * Midi-Kanal gruppiert gesendet, so dass aufeinander folgende Nachrichten
+ * möglichst oft den Running-Status nutzen können.
+ *
+ * @see midi_trigger_instrument
+ */
+void midi_trigger_instruments(uint8_t mask, const uint8_t *velocity);
+
+/**
+ * Mehrere Instrumente sofort beenden
+ *
+ * Schließt die Gates der Instrumente in mask und sendet ihre NoteOffs, nach
+ * Midi-Kanal gruppiert.
+ *
+ * @see midi_gate_close
+ */
+void midi_release_instruments(uint8_t mask);
+
 /**
  * Ein NoteOn-Kommando senden
  *
@@ -177,21 +386,35 @@ void midi_detrigger_instruments(void);
  * note kann von 0-127 eine Note zwischen C -1 und G 9 angeben
  * velocity gibt die Anschlagsstärke im Bereich von 1-127 an (0 entspricht NoteOff).
  */
-void midi_noteon(uint8_t note, uint8_t velocity);
+void midi_noteon(uint8_t channel, uint8_t note, uint8_t velocity);
 
 /**
  * Ein NoteOff-Kommando senden
+ *
+ * @see MIDI_NOTEOFF_AS_NOTEON
  */
-void midi_noteoff(uint8_t note);
+void midi_noteoff(uint8_t channel, uint8_t note);
 
 /**
- * Eine Midi-Controll-Change-Nachricht senden
+ * Eine Midi-Controll-Change-Nachricht auf dem Midi-Kanal channel (0-15) senden
  */
-void midi_cc(uint8_t controller, uint8_t value);
+void midi_cc(uint8_t channel, uint8_t controller, uint8_t value);
 
 /**
- * Den Namen einer Note zusammenbauen
+ * Den Namen einer Note auf dem LCD ausgeben
+ *
+ * Der Name ist immer 4 Zeichen lang:
+ *
+ *  Midi-Note 0  =  "C -1"
+ *            1  =  "C#-1"
+ *              ...
+ *           60  =  "C 4 "
+ *              ...
+ *          127  =  "G 9 "
+ *
+ * Die Namen liegen als Tabelle im Flash und werden direkt von dort mit
+ * lcd_pstring ausgegeben, der Aufruf braucht keinen RAM-Puffer.
  */
-const char* midi_notename(uint8_t note);
+void midi_print_notename(uint8_t note);
 
 #endif /* MIDI_H_ */
@@ -0,0 +1,332 @@
+/**
+ * @file
+ * Zusammenfassen und Drosseln der Control-Change-Nachrichten
+ *
+ * Pro Parameter wird ein Bit im dirty-Bitfeld und der zuletzt gemeldete Wert
+ * gespeichert. Das Budget wird als Token-Bucket geführt: pro Systemtick kommt
+ * das eingestellte Budget hinzu, jeder gesendete Control-Change kostet drei
+ * Bytes. Die vorgemerkten Parameter werden reihum bedient, damit ein einzelnes
+ * schnell bewegtes Poti die anderen nicht aushungert. Ein Parameter wird immer
+ * komplett gesendet, auch wenn er mehrere Control-Changes braucht, das Budget
+ * darf dabei ins Minus laufen und wird dann erst wieder aufgefüllt.
+ *
+ * Die Werte werden intern als 14-Bit-Wert (MSB und LSB zu je 7 Bit) geführt,
+ * der 10-Bit-Wert des ADC landet in den oberen Bits.
+ */
+
+#include <stdint.h>
+
+#include "bits.h"
+#include "io_config.h"
+#include "midi.h"
+#include "midi_control.h"
+#include "timer.h"
+
+/**
+ * Kosten eines Control-Change im Budget
+ *
+ * Mit Running-Status sind es oft nur zwei Bytes, gerechnet wird aber immer mit
+ * der vollen Länge.
+ */
+#define MIDI_CONTROL_COST (3 * MIDI_CONTROL_BUDGET_UNIT)
+
+/**
+ * Obergrenze des angesparten Budgets
+ *
+ * Erlaubt nach einer Pause höchstens zwei Control-Changes am Stück.
+ */
+#define MIDI_CONTROL_BUCKET_MAX (2 * MIDI_CONTROL_COST)
+
+/**
+ * Größte Anzahl an Bytes, die für einen Parameter in die Warteschlange gehen
+ *
+ * Bei NRPN: Parameterauswahl (2 Control-Changes), MSB und LSB.
+ */
+#define MIDI_CONTROL_MAX_BYTES 12
+
+/**
+ * Noch nie gesendeter Wert
+ */
+#define MIDI_CONTROL_UNSENT 0xFFFF
+
+/**
+ * Keine NRPN ausgewählt
+ */
+#define MIDI_CONTROL_NO_NRPN 0xFF
+
+/**
+ * Controller der NRPN-Auswahl und des Data Entry
+ */
+#define MIDI_CC_NRPN_MSB 99
+#define MIDI_CC_NRPN_LSB 98
+#define MIDI_CC_DATA_MSB 6
+#define MIDI_CC_DATA_LSB 38
+
+/**
+ * Zustand der vorgemerkten Control-Changes
+ */
+struct {
+	// Bitfeld der Parameter mit vorgemerktem Wert
+	uint8_t dirty[N_PARAMETERS / 8];
+
+	// Ausgabe-Art pro Parameter, je 2 Bit
+	uint8_t mode[N_PARAMETERS / 4];
+
+	// Zuletzt gemeldeter Wert pro Parameter (14 Bit)
+	uint16_t value[N_PARAMETERS];
+
+	// Zuletzt gesendeter Wert pro Parameter, MIDI_CONTROL_UNSENT wenn noch nie gesendet
+	uint16_t sent[N_PARAMETERS];
+
+	// Parameter der zuletzt ausgewählten NRPN pro Midi-Kanal
+	uint8_t nrpn[16];
+
+	// Midi-Kanal des gerade gesendeten Parameters
+	uint8_t channel;
+
+	// Anzahl der vorgemerkten Parameter
+	uint8_t pending;
+
+	// Nächster zu prüfender Parameter
+	uint8_t cursor;
+
+	// Angespartes Budget in 1/MIDI_CONTROL_BUDGET_UNIT Bytes
+	int16_t tokens;
+
+	// Budget pro Millisekunde
+	uint8_t budget;
+
+	// Systemtick der letzten Auffüllung
+	uint8_t last;
+
+	// Anzahl der überschriebenen Werte
+	uint16_t coalesced;
+
+	// Anzahl der nicht gesendeten, unveränderten Werte
+	uint16_t dropped;
+} midi_control = {
+	.mode = {
+		MIDI_CONTROL_MODE_DEFAULT * 0x55, MIDI_CONTROL_MODE_DEFAULT * 0x55,
+		MIDI_CONTROL_MODE_DEFAULT * 0x55, MIDI_CONTROL_MODE_DEFAULT * 0x55,
+		MIDI_CONTROL_MODE_DEFAULT * 0x55, MIDI_CONTROL_MODE_DEFAULT * 0x55,
+		MIDI_CONTROL_MODE_DEFAULT * 0x55, MIDI_CONTROL_MODE_DEFAULT * 0x55
+	},
+	.sent = {
+		[0 ... N_PARAMETERS - 1] = MIDI_CONTROL_UNSENT
+	},
+	.nrpn = {
+		[0 ... 15] = MIDI_CONTROL_NO_NRPN
+	},
+	.budget = MIDI_CONTROL_BUDGET_DEFAULT
+};
+
+/*
+ * Den neuen Wert eines Parameters vormerken
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_control_set(uint8_t parameter, uint16_t value)
+{
+	uint8_t *dirty = &midi_control.dirty[parameter / 8];
+
+	if(BITSET(*dirty, parameter % 8))
+		midi_control.coalesced++;
+	else
+	{
+		SETBIT(*dirty, parameter % 8);
+		midi_control.pending++;
+	}
+
+	// 10 Bit des ADC auf 14 Bit strecken
+	midi_control.value[parameter] = value << 4;
+}
+
+/*
+ * Der zuletzt gemeldete Wert eines Parameters
+ */
+uint16_t midi_control_get(uint8_t parameter)
+{
+	return midi_control.value[parameter] >> 4;
+}
+
+/*
+ * Die Ausgabe-Art eines Parameters wählen
+ */
+void midi_control_set_mode(uint8_t parameter, uint8_t mode)
+{
+	uint8_t shift = (parameter % 4) * 2;
+	uint8_t *modes = &midi_control.mode[parameter / 4];
+
+	*modes = (*modes & ~(0x03 << shift)) | ((mode & 0x03) << shift);
+
+	// Der nächste Wert wird in jedem Fall komplett gesendet
+	midi_control.sent[parameter] = MIDI_CONTROL_UNSENT;
+}
+
+/*
+ * Die Ausgabe-Art eines Parameters
+ */
+uint8_t midi_control_get_mode(uint8_t parameter)
+{
+	return (midi_control.mode[parameter / 4] >> ((parameter % 4) * 2)) & 0x03;
+}
+
+/**
+ * Einen Control-Change senden und vom Budget abziehen
+ *
+ * Die Data-Entry-Controller würden bei einem Empfänger die zuletzt gewählte
+ * NRPN verstellen. Ist eine NRPN gewählt, wird die Auswahl daher vorher
+ * aufgehoben.
+ */
+static void midi_control_cc(uint8_t controller, uint8_t value)
+{
+	uint8_t channel = midi_control.channel;
+
+	if((controller == MIDI_CC_DATA_MSB || controller == MIDI_CC_DATA_LSB) && midi_control.nrpn[channel] != MIDI_CONTROL_NO_NRPN)
+	{
+		midi_cc(channel, MIDI_CC_NRPN_MSB, 127);
+		midi_cc(channel, MIDI_CC_NRPN_LSB, 127);
+		midi_control.tokens -= 2 * MIDI_CONTROL_COST;
+		midi_control.nrpn[channel] = MIDI_CONTROL_NO_NRPN;
+	}
+
+	midi_cc(channel, controller, value);
+	midi_control.tokens -= MIDI_CONTROL_COST;
+}
+
+/**
+ * Den vorgemerkten Wert eines Parameters in seiner Ausgabe-Art senden
+ *
+ * Gibt 0 zurück, wenn der Wert nicht gesendet werden musste, weil er dem
+ * zuletzt gesendeten Wert entspricht.
+ */
+static uint8_t midi_control_send(uint8_t parameter)
+{
+	uint16_t value = midi_control.value[parameter];
+	uint16_t sent = midi_control.sent[parameter];
+	uint8_t msb = value >> 7;
+	uint8_t lsb = value & 0x7F;
+	uint8_t msb_changed = (sent == MIDI_CONTROL_UNSENT) || (msb != (sent >> 7));
+
+	// Gesendet wird auf dem Kanal des Instruments, zu dem der Parameter gehört
+	uint8_t channel = midi_instruments[parameter / N_PARAMETERS_PER_INSTRUMENT].channel;
+	midi_control.channel = channel;
+
+	switch(midi_control_get_mode(parameter))
+	{
+		case MIDI_CONTROL_CC14: {
+			if(value == sent)
+				return 0;
+
+			// Das MSB nur senden, wenn es sich geändert hat. Danach muss das
+			// LSB immer folgen, weil der Empfänger es beim MSB zurücksetzt.
+			if(msb_changed)
+				midi_control_cc(parameter, msb);
+
+			midi_control_cc(parameter + 32, lsb);
+			break;
+		}
+
+		case MIDI_CONTROL_NRPN: {
+			if(value == sent)
+				return 0;
+
+			// Die NRPN nur auswählen, wenn zuletzt eine andere gewählt war
+			if(midi_control.nrpn[channel] != parameter)
+			{
+				midi_cc(channel, MIDI_CC_NRPN_MSB, MIDI_CONTROL_NRPN_MSB);
+				midi_cc(channel, MIDI_CC_NRPN_LSB, parameter);
+				midi_control.tokens -= 2 * MIDI_CONTROL_COST;
+				midi_control.nrpn[channel] = parameter;
+			}
+
+			if(msb_changed)
+			{
+				midi_cc(channel, MIDI_CC_DATA_MSB, msb);
+				midi_control.tokens -= MIDI_CONTROL_COST;
+			}
+
+			midi_cc(channel, MIDI_CC_DATA_LSB, lsb);
+			midi_control.tokens -= MIDI_CONTROL_COST;
+			break;
+		}
+
+		default: {
+			// 7-Bit: nur die oberen Bits zählen
+			if(!msb_changed)
+				return 0;
+
+			midi_control_cc(parameter, msb);
+			break;
+		}
+	}
+
+	midi_control.sent[parameter] = value;
+	return 1;
+}
+
+/*
+ * Vorgemerkte Control-Changes im Rahmen des Budgets senden
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_control_drain(void)
+{
+	// Budget für die vergangenen Systemticks gutschreiben
+	uint8_t now = timer_millis();
+	// Vorzeichenbehaftet rechnen, damit Schulden (negativer Stand) erhalten bleiben
+	int32_t tokens = (int32_t)midi_control.tokens + (int32_t)(uint8_t)(now - midi_control.last) * midi_control.budget;
+	midi_control.tokens = (tokens > MIDI_CONTROL_BUCKET_MAX) ? MIDI_CONTROL_BUCKET_MAX : tokens;
+	midi_control.last = now;
+
+	// Solange noch Noten eines Steps auf das Senden warten, haben diese Vorrang
+	if(midi_tx_pending(MIDI_TX_NOTEON) || midi_tx_pending(MIDI_TX_NOTEOFF))
+		return;
+
+	while(midi_control.pending && midi_control.tokens >= MIDI_CONTROL_COST && midi_tx_free(MIDI_TX_CONTROL) >= MIDI_CONTROL_MAX_BYTES)
+	{
+		uint8_t parameter = midi_control.cursor;
+		midi_control.cursor = (parameter + 1) % N_PARAMETERS;
+
+		uint8_t *dirty = &midi_control.dirty[parameter / 8];
+		if(!BITSET(*dirty, parameter % 8))
+			continue;
+
+		CLEARBIT(*dirty, parameter % 8);
+		midi_control.pending--;
+
+		// Das Poti steht wieder auf dem zuletzt gesendeten Wert
+		if(!midi_control_send(parameter))
+			midi_control.dropped++;
+	}
+}
+
+/*
+ * Das Bandbreiten-Budget setzen
+ */
+void midi_control_set_budget(uint8_t budget)
+{
+	midi_control.budget = budget ? budget : 1;
+}
+
+/*
+ * Das aktuelle Bandbreiten-Budget
+ */
+uint8_t midi_control_get_budget(void)
+{
+	return midi_control.budget;
+}
+
+/*
+ * Anzahl der überschriebenen Werte
+ */
+uint16_t midi_control_coalesced(void)
+{
+	return midi_control.coalesced;
+}
+
+/*
+ * Anzahl der nicht gesendeten, unveränderten Werte
+ */
+uint16_t midi_control_dropped(void)
+{
+	return midi_control.dropped;
+}
@@ -0,0 +1,136 @@
+/**
+ * @file
+ * Zusammenfassen und Drosseln der Control-Change-Nachrichten, externes Interface
+ *
+ * Die Potis der Parameter liefern bei jeder Bewegung eine Flut von Änderungen.
+ * Statt jede Änderung sofort als Control-Change zu senden, wird pro Parameter
+ * nur der letzte Wert vorgemerkt. Die vorgemerkten Werte werden im
+ * Hauptprogramm nur im Rahmen eines einstellbaren Bandbreiten-Budgets und nur
+ * dann gesendet, wenn keine Noten auf das Senden warten, so dass die NoteOns
+ * der Steps nie hinter Control-Changes warten müssen.
+ *
+ * Die Parameter werden mit 10 Bit gemeldet. Pro Parameter lässt sich wählen, ob
+ * er als einfacher 7-Bit-Control-Change, als 14-Bit-Control-Change-Paar oder als
+ * NRPN gesendet wird. Bei den hochauflösenden Varianten wird das MSB nur
+ * gesendet, wenn es sich geändert hat.
+ *
+ * Jeder Parameter wird auf dem Midi-Kanal des Instruments gesendet, zu dem er
+ * gehört. Die zuletzt ausgewählte NRPN wird daher pro Kanal geführt.
+ */
+
+#ifndef MIDI_CONTROL_H_
+#define MIDI_CONTROL_H_
+
+#include <stdint.h>
+
+/**
+ * Einheiten des Bandbreiten-Budgets pro Byte
+ *
+ * Das Budget wird in 1/MIDI_CONTROL_BUDGET_UNIT Bytes pro Millisekunde
+ * angegeben.
+ */
+#define MIDI_CONTROL_BUDGET_UNIT 8
+
+/**
+ * Bandbreiten-Budget nach dem Einschalten
+ *
+ * 12/8 = 1,5 Bytes pro Millisekunde, das ist knapp die Hälfte der bei 31250
+ * Baud möglichen 3,125 Bytes pro Millisekunde.
+ */
+#define MIDI_CONTROL_BUDGET_DEFAULT 12
+
+/**
+ * Ausgabe als 7-Bit-Control-Change mit der Parameternummer als Controller
+ */
+#define MIDI_CONTROL_CC7 0
+
+/**
+ * Ausgabe als 14-Bit-Control-Change-Paar
+ *
+ * Das MSB geht an den Controller mit der Parameternummer (0-31), das LSB an den
+ * Controller mit der Parameternummer + 32.
+ */
+#define MIDI_CONTROL_CC14 1
+
+/**
+ * Ausgabe als NRPN
+ *
+ * Die NRPN-Nummer setzt sich aus MIDI_CONTROL_NRPN_MSB und der Parameternummer
+ * zusammen, der Wert wird über Data Entry (Controller 6 und 38) gesendet.
+ */
+#define MIDI_CONTROL_NRPN 2
+
+/**
+ * Ausgabe-Art nach dem Einschalten
+ */
+#define MIDI_CONTROL_MODE_DEFAULT MIDI_CONTROL_CC7
+
+/**
+ * MSB der NRPN-Nummern der Parameter
+ */
+#define MIDI_CONTROL_NRPN_MSB 0
+
+/**
+ * Den neuen Wert eines Parameters vormerken
+ *
+ * value hat die volle Auflösung des ADC (0 bis IO_PARAMETER_MAX). Ein noch
+ * nicht gesendeter Wert desselben Parameters wird überschrieben.
+ */
+void midi_control_set(uint8_t parameter, uint16_t value);
+
+/**
+ * Der zuletzt gemeldete Wert eines Parameters (0 bis IO_PARAMETER_MAX)
+ */
+uint16_t midi_control_get(uint8_t parameter);
+
+/**
+ * Die Ausgabe-Art eines Parameters wählen
+ *
+ * @see MIDI_CONTROL_CC7
+ * @see MIDI_CONTROL_CC14
+ * @see MIDI_CONTROL_NRPN
+ */
+void midi_control_set_mode(uint8_t parameter, uint8_t mode);
+
+/**
+ * Die Ausgabe-Art eines Parameters
+ *
+ * @see midi_control_set_mode
+ */
+uint8_t midi_control_get_mode(uint8_t parameter);
+
+/**
+ * Vorgemerkte Control-Changes im Rahmen des Budgets senden
+ *
+ * Sendet nichts, solange noch NoteOns oder NoteOffs auf das Senden warten.
+ * Wird von midi_dispatch nach den Steps und den NoteOffs aufgerufen.
+ */
+void midi_control_drain(void);
+
+/**
+ * Das Bandbreiten-Budget setzen
+ *
+ * budget ist in 1/MIDI_CONTROL_BUDGET_UNIT Bytes pro Millisekunde angegeben,
+ * 0 wird als 1 behandelt.
+ */
+void midi_control_set_budget(uint8_t budget);
+
+/**
+ * Das aktuelle Bandbreiten-Budget
+ *
+ * @see midi_control_set_budget
+ */
+uint8_t midi_control_get_budget(void);
+
+/**
+ * Anzahl der Werte, die vor dem Senden von einem neueren Wert überschrieben wurden
+ */
+uint16_t midi_control_coalesced(void);
+
+/**
+ * Anzahl der vorgemerkten Werte, die nicht gesendet wurden, weil sie dem
+ * zuletzt gesendeten Wert entsprachen
+ */
+uint16_t midi_control_dropped(void);
+
+#endif /* MIDI_CONTROL_H_ */
@@ -0,0 +1,173 @@
+/**
+ * @file
+ * Zeitgesteuertes Abschalten getriggerter Instrumente
+ *
+ * Das Timer-Rad besteht aus MIDI_GATE_SLOTS Bitfeldern mit je einem Bit pro
+ * Instrument. Ein Gate, das in n Millisekunden abläuft, wird in das Fach
+ * (position + n) % MIDI_GATE_SLOTS eingetragen, zusätzlich wird gezählt, wie
+ * viele volle Umdrehungen es vorher noch warten muss. Pro Systemtick muss so
+ * nur ein einziges Fach betrachtet werden, egal wie viele Gates offen sind.
+ *
+ * Das Rad wird im Hauptprogramm gedreht, die Midi-Ausgabe bleibt damit aus
+ * den Interrupts heraus.
+ */
+
+#include <stdint.h>
+
+#include "bits.h"
+#include "io_config.h"
+#include "midi.h"
+#include "midi_gate.h"
+#include "timer.h"
+#include "clock.h"
+
+/**
+ * Gate-Länge der Instrumente
+ *
+ * @see midi_gate_set_length
+ */
+uint8_t midi_gate_length[N_INSTRUMENTS] = {
+	MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT,
+	MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT, MIDI_GATE_DEFAULT
+};
+
+/**
+ * Zustand des Timer-Rads
+ */
+struct {
+	// Bitfeld der Instrumente, deren Gate in diesem Fach abläuft
+	uint8_t slots[MIDI_GATE_SLOTS];
+
+	// Anzahl der Umdrehungen, die das Gate eines Instruments noch warten muss
+	uint8_t rounds[N_INSTRUMENTS];
+
+	// Fach, in das das Gate eines Instruments eingetragen ist
+	uint8_t slot[N_INSTRUMENTS];
+
+	// Bitfeld der Instrumente mit offenem Gate
+	uint8_t active;
+
+	// Zuletzt bearbeitetes Fach
+	uint8_t position;
+
+	// Systemtick, bis zu dem das Rad gedreht wurde
+	uint8_t last;
+} midi_gate_wheel;
+
+/*
+ * Die Gate-Länge eines Instruments setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_gate_set_length(uint8_t instrument, uint8_t gate)
+{
+	midi_gate_length[instrument] = gate;
+}
+
+/*
+ * Die Gate-Länge eines Instruments
+ */
+uint8_t midi_gate_get_length(uint8_t instrument)
+{
+	return midi_gate_length[instrument];
+}
+
+/*
+ * Gibt 1 zurück, wenn die Note des Instruments gerade klingt
+ */
+uint8_t midi_gate_active(uint8_t instrument)
+{
+	return BITSET(midi_gate_wheel.active, instrument) ? 1 : 0;
+}
+
+/**
+ * Die Gate-Länge eines Instruments in Millisekunden
+ */
+static uint16_t midi_gate_millis(uint8_t instrument)
+{
+	uint8_t gate = midi_gate_length[instrument];
+
+	if(!BITSET(gate, 7))
+		return gate;
+
+	// Ticks über den aktuellen Tick-Abstand des Taktgebers umrechnen, gerundet
+	uint32_t ticks = (uint32_t)(gate & 0x7F) * clock_tick_interval();
+	return (ticks + TIMER_TICKS_PER_MS / 2) / TIMER_TICKS_PER_MS;
+}
+
+/*
+ * Das Gate eines soeben getriggerten Instruments öffnen
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_gate_open(uint8_t instrument)
+{
+	midi_gate_close(instrument);
+
+	// Das Rad kann dem Systemtick etwas hinterherhängen, die Gate-Länge wird
+	// vom aktuellen Systemtick aus gezählt und nicht von der Position des Rads
+	uint16_t delay = midi_gate_millis(instrument);
+	if(delay == 0)
+		delay = 1;
+
+	delay += (uint8_t)(timer_millis() - midi_gate_wheel.last);
+
+	// Das Fach wird erstmals nach ((delay - 1) % SLOTS) + 1 Ticks erreicht
+	uint16_t rounds = (delay - 1) / MIDI_GATE_SLOTS;
+	if(rounds > UINT8_MAX)
+		rounds = UINT8_MAX;
+
+	uint8_t slot = (midi_gate_wheel.position + delay) & (MIDI_GATE_SLOTS - 1);
+
+	midi_gate_wheel.rounds[instrument] = rounds;
+	midi_gate_wheel.slot[instrument] = slot;
+	SETBIT(midi_gate_wheel.slots[slot], instrument);
+	SETBIT(midi_gate_wheel.active, instrument);
+}
+
+/*
+ * Das Gate eines Instruments schließen, ohne ein NoteOff zu senden
+ */
+void midi_gate_close(uint8_t instrument)
+{
+	if(!BITSET(midi_gate_wheel.active, instrument))
+		return;
+
+	CLEARBIT(midi_gate_wheel.slots[midi_gate_wheel.slot[instrument]], instrument);
+	CLEARBIT(midi_gate_wheel.active, instrument);
+}
+
+/*
+ * Das Timer-Rad bis zum aktuellen Systemtick weiterdrehen
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_gate_poll(void)
+{
+	uint8_t now = timer_millis();
+
+	while(midi_gate_wheel.last != now)
+	{
+		midi_gate_wheel.last++;
+		midi_gate_wheel.position = (midi_gate_wheel.position + 1) & (MIDI_GATE_SLOTS - 1);
+
+		uint8_t due = midi_gate_wheel.slots[midi_gate_wheel.position];
+		uint8_t expired = 0;
+
+		for(uint8_t instrument = 0; due; instrument++, due >>= 1)
+		{
+			if(!(due & 1))
+				continue;
+
+			// Das Gate muss noch weitere Umdrehungen warten
+			if(midi_gate_wheel.rounds[instrument])
+			{
+				midi_gate_wheel.rounds[instrument]--;
+				continue;
+			}
+
+			SETBIT(expired, instrument);
+		}
+
+		// Gates schließen und NoteOffs nach Kanälen gruppiert senden
+		if(expired)
+			midi_release_instruments(expired);
+	}
+}
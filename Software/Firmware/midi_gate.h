@@ -0,0 +1,89 @@
+/**
+ * @file
+ * Zeitgesteuertes Abschalten getriggerter Instrumente, externes Interface
+ *
+ * Jedes getriggerte Instrument wird nach einer einstellbaren Gate-Länge
+ * wieder abgeschaltet. Die Gate-Länge wird entweder in Millisekunden oder in
+ * Ticks des Taktgebers (96 ppqn) angegeben.
+ *
+ * Die anstehenden NoteOff-Nachrichten werden in einem Timer-Rad mit
+ * MIDI_GATE_SLOTS Fächern verwaltet, das vom Systemtick (1ms) weitergedreht
+ * wird. Die NoteOffs verteilen sich so über die Zeit zwischen zwei Steps, statt
+ * gesammelt vor den NoteOns des nächsten Steps gesendet zu werden.
+ */
+
+#ifndef MIDI_GATE_H_
+#define MIDI_GATE_H_
+
+#include <stdint.h>
+
+/**
+ * Anzahl der Fächer des Timer-Rads
+ *
+ * Jedes Fach entspricht einer Millisekunde, längere Gates laufen in mehreren
+ * Umdrehungen ab. Muss eine Zweierpotenz sein.
+ */
+#define MIDI_GATE_SLOTS 16
+
+#if (MIDI_GATE_SLOTS & (MIDI_GATE_SLOTS - 1)) != 0
+#error "MIDI_GATE_SLOTS muss eine Zweierpotenz sein"
+#endif
+
+/**
+ * Kennzeichnet eine Gate-Länge in Ticks des Taktgebers statt in Millisekunden
+ *
+ * Die Länge steht dann in den unteren 7 Bits, z.B. ergibt
+ * (MIDI_GATE_TICKS | 24) eine Viertelnote.
+ */
+#define MIDI_GATE_TICKS 0x80
+
+/**
+ * Gate-Länge der Instrumente nach dem Einschalten
+ */
+#define MIDI_GATE_DEFAULT 50
+
+/**
+ * Die Gate-Länge eines Instruments setzen
+ *
+ * gate ist die Länge in Millisekunden (1-127) oder mit MIDI_GATE_TICKS
+ * verknüpft in Ticks des Taktgebers. Eine Länge von 0 wird als 1 behandelt.
+ * Die Änderung wirkt ab dem nächsten Trigger.
+ */
+void midi_gate_set_length(uint8_t instrument, uint8_t gate);
+
+/**
+ * Die Gate-Länge eines Instruments
+ *
+ * @see midi_gate_set_length
+ */
+uint8_t midi_gate_get_length(uint8_t instrument);
+
+/**
+ * Gibt 1 zurück, wenn die Note des Instruments gerade klingt
+ */
+uint8_t midi_gate_active(uint8_t instrument);
+
+/**
+ * Das Gate eines soeben getriggerten Instruments öffnen
+ *
+ * Plant die NoteOff-Nachricht nach Ablauf der Gate-Länge ein. Ein bereits
+ * eingeplantes NoteOff des Instruments wird dabei ersetzt.
+ */
+void midi_gate_open(uint8_t instrument);
+
+/**
+ * Das Gate eines Instruments schließen, ohne ein NoteOff zu senden
+ */
+void midi_gate_close(uint8_t instrument);
+
+/**
+ * Das Timer-Rad bis zum aktuellen Systemtick weiterdrehen
+ *
+ * Sendet die NoteOff-Nachrichten aller abgelaufenen Gates. Wird von
+ * midi_dispatch nach der Verarbeitung der empfangenen Ereignisse aufgerufen,
+ * so dass NoteOns eines Steps vor gleichzeitig ablaufenden NoteOffs gesendet
+ * werden.
+ */
+void midi_gate_poll(void);
+
+#endif /* MIDI_GATE_H_ */
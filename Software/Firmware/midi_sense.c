@@ -0,0 +1,164 @@
+/**
+ * @file
+ * Active Sensing und Überwachung der externen Clock
+ */
+
+#include <stdint.h>
+#include <util/atomic.h>
+
+#include "midi.h"
+#include "midi_sense.h"
+#include "timer.h"
+
+/**
+ * Flag des Empfangs-Interrupts: ein beliebiges Byte wurde empfangen
+ */
+#define MIDI_SENSE_RX 0x01
+
+/**
+ * Flag des Empfangs-Interrupts: eine Midi-Clock wurde empfangen
+ */
+#define MIDI_SENSE_CLOCK 0x02
+
+/**
+ * Flag des Empfangs-Interrupts: ein Active Sensing wurde empfangen
+ */
+#define MIDI_SENSE_SENSING 0x04
+
+/**
+ * Zustand der Überwachung
+ */
+struct {
+	// Vom Empfangs-Interrupt gesetzte MIDI_SENSE_*-Flags
+	volatile uint8_t received;
+
+	// 1, sobald ein Active Sensing empfangen wurde
+	uint8_t sensing;
+
+	// 1, wenn in Sendepausen Active Sensing gesendet wird
+	uint8_t output;
+
+	// MIDI_SENSE_LOST_*-Bits der letzten Zeitüberschreitung
+	uint8_t lost;
+
+	// Stand des Millisekunden-Zählers beim letzten Aufruf von midi_sense_poll
+	uint8_t last;
+
+	// ms seit dem letzten empfangenen Byte
+	uint16_t silence;
+
+	// ms seit der letzten empfangenen Midi-Clock
+	uint16_t clock_silence;
+
+	// ms seit dem letzten gesendeten Byte
+	uint16_t idle;
+} midi_sense;
+
+/*
+ * Ein empfangenes Byte melden
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_sense_receive(uint8_t input)
+{
+	uint8_t flags = MIDI_SENSE_RX;
+
+	if(input == MIDI_CLOCK)
+		flags |= MIDI_SENSE_CLOCK;
+	else if(input == MIDI_ACTIVE_SENSING)
+		flags |= MIDI_SENSE_SENSING;
+
+	midi_sense.received |= flags;
+}
+
+/*
+ * Die Zeitüberschreitungen prüfen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t midi_sense_poll(uint8_t clock)
+{
+	uint8_t result = 0;
+	uint8_t flags;
+
+	// Der Aufruf erfolgt nach jedem Durchlauf von io_sync, also deutlich
+	// häufiger als der 8-Bit-Zähler überläuft
+	uint8_t now = timer_millis();
+	uint8_t delta = now - midi_sense.last;
+	midi_sense.last = now;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		flags = midi_sense.received;
+		midi_sense.received = 0;
+	}
+
+	// Active Sensing erst überwachen, nachdem die Gegenstelle es einmal gesendet hat
+	if(flags & MIDI_SENSE_SENSING)
+	{
+		midi_sense.sensing = 1;
+		midi_sense.lost &= ~MIDI_SENSE_LOST_CONNECTION;
+	}
+
+	if((flags & MIDI_SENSE_RX) || !midi_sense.sensing)
+	{
+		midi_sense.silence = 0;
+	}
+	else if((midi_sense.silence += delta) >= MIDI_SENSE_TIMEOUT)
+	{
+		midi_sense.sensing = 0;
+		midi_sense.silence = 0;
+		midi_sense.lost |= MIDI_SENSE_LOST_CONNECTION;
+		result |= MIDI_SENSE_LOST_CONNECTION;
+	}
+
+	if(flags & MIDI_SENSE_CLOCK)
+		midi_sense.lost &= ~MIDI_SENSE_LOST_CLOCK;
+
+	// Eine verlorene Clock nur einmal melden, bis wieder eine empfangen wurde
+	if((flags & MIDI_SENSE_CLOCK) || !clock || (midi_sense.lost & MIDI_SENSE_LOST_CLOCK))
+	{
+		midi_sense.clock_silence = 0;
+	}
+	else if((midi_sense.clock_silence += delta) >= MIDI_SENSE_CLOCK_TIMEOUT)
+	{
+		midi_sense.clock_silence = 0;
+		midi_sense.lost |= MIDI_SENSE_LOST_CLOCK;
+		result |= MIDI_SENSE_LOST_CLOCK;
+	}
+
+	// In Sendepausen selbst Active Sensing senden
+	if(!midi_sense.output || midi_tx_sent())
+	{
+		midi_sense.idle = 0;
+	}
+	else if((midi_sense.idle += delta) >= MIDI_SENSE_IDLE)
+	{
+		midi_sense.idle = 0;
+		midi_send(MIDI_ACTIVE_SENSING);
+	}
+
+	return result;
+}
+
+/*
+ * Die MIDI_SENSE_LOST_*-Bits der letzten Zeitüberschreitung
+ */
+uint8_t midi_sense_lost(void)
+{
+	return midi_sense.lost;
+}
+
+/*
+ * Das Senden von Active Sensing ein- oder ausschalten
+ */
+void midi_sense_set_output(uint8_t enable)
+{
+	midi_sense.output = enable ? 1 : 0;
+}
+
+/*
+ * Gibt 1 zurück, wenn in Sendepausen Active Sensing gesendet wird
+ */
+uint8_t midi_sense_get_output(void)
+{
+	return midi_sense.output;
+}
@@ -0,0 +1,88 @@
+/**
+ * @file
+ * Active Sensing und Überwachung der externen Clock, externes Interface
+ *
+ * Sobald ein Active-Sensing-Byte (0xFE) empfangen wurde, erwartet die Microdrum
+ * spätestens alle MIDI_SENSE_TIMEOUT ms ein weiteres Byte. Bleibt es aus, gilt
+ * die Verbindung als getrennt (z.B. ein abgezogener USB-Midi-Host): alle
+ * offenen Noten werden beendet und Active Sensing bis zum nächsten 0xFE nicht
+ * mehr erwartet.
+ *
+ * Unabhängig davon muss bei externer, laufender Clock spätestens alle
+ * MIDI_SENSE_CLOCK_TIMEOUT ms eine Midi-Clock kommen. Sonst werden ebenfalls
+ * alle Noten beendet, die Position auf den ersten Step zurückgesetzt und die
+ * PLL rastet auf die nächste empfangene Clock neu ein.
+ *
+ * Die Zeiten werden mit dem Millisekunden-Zähler des Timers gemessen. Der
+ * Empfangs-Interrupt setzt nur Flags, gezählt wird im Hauptprogramm.
+ *
+ * Auf Wunsch sendet die Microdrum selbst Active Sensing, wenn sie länger als
+ * MIDI_SENSE_IDLE ms nichts gesendet hat.
+ */
+
+#ifndef MIDI_SENSE_H_
+#define MIDI_SENSE_H_
+
+#include <stdint.h>
+
+/**
+ * Active-Sensing-Byte
+ */
+#define MIDI_ACTIVE_SENSING 0xFE
+
+/**
+ * Zeit in ms, nach der ohne empfangenes Byte die Verbindung als getrennt gilt
+ */
+#define MIDI_SENSE_TIMEOUT 300
+
+/**
+ * Zeit in ms, nach der ohne empfangene Midi-Clock die Clock als verloren gilt
+ */
+#define MIDI_SENSE_CLOCK_TIMEOUT 500
+
+/**
+ * Zeit in ms ohne gesendetes Byte, nach der selbst Active Sensing gesendet wird
+ */
+#define MIDI_SENSE_IDLE 270
+
+/**
+ * Ergebnis von midi_sense_poll: Active Sensing ist ausgeblieben
+ */
+#define MIDI_SENSE_LOST_CONNECTION 0x01
+
+/**
+ * Ergebnis von midi_sense_poll: die externe Clock ist ausgeblieben
+ */
+#define MIDI_SENSE_LOST_CLOCK 0x02
+
+/**
+ * Ein empfangenes Byte im Empfangs-Interrupt melden
+ */
+void midi_sense_receive(uint8_t input);
+
+/**
+ * Die Zeiten seit dem letzten Aufruf verbuchen und die Zeitüberschreitungen prüfen
+ *
+ * Wird von midi_dispatch aufgerufen. clock ist 1, solange eine externe Clock
+ * erwartet wird. Gibt eine Kombination der MIDI_SENSE_LOST_*-Bits zurück, jede
+ * Zeitüberschreitung wird nur einmal gemeldet.
+ */
+uint8_t midi_sense_poll(uint8_t clock);
+
+/**
+ * Gibt die MIDI_SENSE_LOST_*-Bits der letzten Zeitüberschreitung zurück, bis
+ * wieder ein Active Sensing bzw. eine Clock empfangen wurde
+ */
+uint8_t midi_sense_lost(void);
+
+/**
+ * Das Senden von Active Sensing in Sendepausen ein- (1) oder ausschalten (0)
+ */
+void midi_sense_set_output(uint8_t enable);
+
+/**
+ * Gibt 1 zurück, wenn in Sendepausen Active Sensing gesendet wird
+ */
+uint8_t midi_sense_get_output(void);
+
+#endif /* MIDI_SENSE_H_ */
@@ -0,0 +1,592 @@
+/**
+ * @file
+ * Sichern und Laden der Einstellungen per SysEx
+ *
+ * Der Empfangs-Interrupt sammelt eine SysEx-Nachricht in einem Puffer von der
+ * Größe eines Stücks, prüft Länge und CRC und legt das entpackte Stück in ein
+ * Postfach. Das Hauptprogramm übernimmt die Daten aus dem Postfach, quittiert
+ * und gibt das Postfach wieder frei. Da der Host jedes Stück erst nach der
+ * Quittung des vorherigen sendet, reicht ein einziges Postfach.
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "io_config.h"
+#include "io_parameter.h"
+#include "midi.h"
+#include "midi_control.h"
+#include "midi_thru.h"
+#include "eeprom_queue.h"
+#include "midi_sysex.h"
+#include "pattern.h"
+#include "song.h"
+#include "track.h"
+
+/**
+ * Länge einer MIDI_SYSEX_DATA-Nachricht ohne F0 und F7
+ *
+ * Hersteller, Kommando, Block, Stück, 8 gepackte Datenbytes und CRC.
+ */
+#define MIDI_SYSEX_DATA_LENGTH 13
+
+/**
+ * Länge einer MIDI_SYSEX_DATA-Nachricht inklusive F0 und F7
+ */
+#define MIDI_SYSEX_MESSAGE_LENGTH (MIDI_SYSEX_DATA_LENGTH + 2)
+
+// Ein Stück wird nur komplett eingereiht, sonst würde der Dump nie fortgesetzt
+#if MIDI_SYSEX_MESSAGE_LENGTH > MIDI_TX_BUFFER_SIZE - 1
+#error "MIDI_SYSEX_MESSAGE_LENGTH passt nicht in die Sende-Warteschlange, MIDI_TX_BUFFER_SIZE vergrößern"
+#endif
+
+/**
+ * Empfangspuffer, wird nur im Empfangs-Interrupt benutzt
+ */
+struct {
+	// Anzahl der empfangenen Bytes, bleibt bei 0xFF stehen
+	uint8_t count;
+
+	// Empfangene Bytes hinter dem 0xF0
+	uint8_t data[MIDI_SYSEX_DATA_LENGTH];
+} midi_sysex_rx;
+
+/**
+ * Postfach für ein empfangenes Stück
+ *
+ * full wird vom Empfangs-Interrupt gesetzt und vom Hauptprogramm gelöscht,
+ * die übrigen Felder gehören solange dem Hauptprogramm.
+ */
+struct {
+	// 1, solange das Stück noch nicht verarbeitet wurde
+	volatile uint8_t full;
+
+	// Ergebnis der Prüfung im Empfangs-Interrupt
+	uint8_t status;
+
+	// Block und Stück
+	uint8_t block;
+	uint8_t chunk;
+
+	// Entpackte Nutzdaten
+	uint8_t data[MIDI_SYSEX_CHUNK_SIZE];
+
+	// Anzahl der schon übernommenen Bytes, wenn das Übernehmen auf ein
+	// Pattern wartet
+	uint8_t applied;
+
+	// 1, solange das Übernehmen auf ein Pattern wartet
+	uint8_t waiting;
+} midi_sysex_mailbox;
+
+/**
+ * Zustand eines laufenden Dumps
+ */
+struct {
+	// 1, solange ein Dump läuft
+	uint8_t active;
+
+	// 1, wenn seit dem letzten Stück ein Step vergangen ist
+	uint8_t allowance;
+
+	// Nächster zu sendender Block und nächstes Stück
+	uint8_t block;
+	uint8_t chunk;
+
+	// Schon gelesene Bytes des nächsten Stücks
+	uint8_t data[MIDI_SYSEX_CHUNK_SIZE];
+	uint8_t filled;
+} midi_sysex_dump_state;
+
+/**
+ * Zwischenspeicher für das erste Byte eines Paares beim Laden (LSB eines
+ * Parameters, Midi-Kanal eines Instruments oder Pattern eines Song-Eintrags)
+ */
+uint8_t midi_sysex_lsb;
+
+/**
+ * Anzahl der verworfenen Stücke
+ */
+uint16_t midi_sysex_rejects;
+
+/**
+ * Eine CRC-7 (Polynom x^7 + x^3 + 1) um ein Byte weiterrechnen
+ */
+static uint8_t midi_sysex_crc(uint8_t crc, uint8_t data)
+{
+	for(uint8_t bit = 0; bit < 8; bit++)
+	{
+		crc <<= 1;
+
+		if((data ^ crc) & 0x80)
+			crc ^= 0x09;
+
+		data <<= 1;
+	}
+
+	return crc & 0x7F;
+}
+
+/**
+ * Die CRC-7 über eine Folge von Bytes berechnen
+ */
+static uint8_t midi_sysex_crc_block(const uint8_t *data, uint8_t length)
+{
+	uint8_t crc = 0;
+
+	while(length--)
+		crc = midi_sysex_crc(crc, *data++);
+
+	return crc;
+}
+
+/**
+ * Größe eines Blocks in Bytes
+ */
+static uint16_t midi_sysex_block_size(uint8_t block)
+{
+	switch(block)
+	{
+		case MIDI_SYSEX_BLOCK_INSTRUMENTS:
+			return N_INSTRUMENTS * sizeof(midi_instrument_t);
+
+		case MIDI_SYSEX_BLOCK_PARAMETERS:
+			return N_PARAMETERS * 2;
+
+		case MIDI_SYSEX_BLOCK_PATTERNS:
+			return N_PATTERNS * sizeof(pattern_t);
+
+		case MIDI_SYSEX_BLOCK_STATISTICS:
+			return N_MIDI_SYSEX_STATISTICS * 2;
+
+		case MIDI_SYSEX_BLOCK_SONG:
+			return SONG_N_ENTRIES * sizeof(song_entry_t);
+
+		case MIDI_SYSEX_BLOCK_TRACKS:
+			return N_INSTRUMENTS * MIDI_SYSEX_TRACK_SIZE;
+	}
+
+	return 0;
+}
+
+/**
+ * Einen Zähler des Blocks MIDI_SYSEX_BLOCK_STATISTICS lesen
+ */
+static uint16_t midi_sysex_statistic(uint8_t index)
+{
+	switch(index)
+	{
+		case 0:
+			return midi_rx_errors(MIDI_RX_FRAMING);
+
+		case 1:
+			return midi_rx_errors(MIDI_RX_OVERRUN);
+
+		case 2:
+			return midi_rx_errors(MIDI_RX_PARITY);
+
+		case 3:
+			return midi_event_overflows();
+
+		case 4:
+			return midi_tx_overflows();
+
+		case 5:
+			return midi_thru_dropped();
+
+		case 6:
+			return midi_sysex_rejected();
+
+		case 7:
+			return eeprom_queue_depth();
+
+		case 8:
+			return eeprom_queue_writes();
+
+		default:
+			return pattern_slot_writes(index - 9);
+	}
+
+	return 0;
+}
+
+/**
+ * Ein Byte eines Blocks lesen
+ */
+static uint8_t midi_sysex_value(uint8_t block, uint16_t offset)
+{
+	switch(block)
+	{
+		case MIDI_SYSEX_BLOCK_INSTRUMENTS: {
+			midi_instrument_t *map = &midi_instruments[offset / 2];
+			return (offset & 1) ? map->note : map->channel;
+		}
+
+		case MIDI_SYSEX_BLOCK_PARAMETERS: {
+			uint16_t value = midi_control_get(offset / 2);
+			return (offset & 1) ? (value >> 8) : (value & 0xFF);
+		}
+
+		case MIDI_SYSEX_BLOCK_STATISTICS: {
+			uint16_t value = midi_sysex_statistic(offset / 2);
+			return (offset & 1) ? (value >> 8) : (value & 0xFF);
+		}
+
+		case MIDI_SYSEX_BLOCK_SONG:
+			return (offset & 1) ? song_get_repeats(offset / 2) : song_get_pattern(offset / 2);
+
+		case MIDI_SYSEX_BLOCK_TRACKS: {
+			uint8_t instrument = offset / MIDI_SYSEX_TRACK_SIZE;
+
+			switch(offset % MIDI_SYSEX_TRACK_SIZE)
+			{
+				case 0:
+					return track_get_length(instrument);
+
+				case 1:
+					return track_get_multiplier(instrument);
+
+				default:
+					return track_get_divider(instrument);
+			}
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Ein Byte eines Blocks nach data lesen
+ *
+ * Gibt 0 zurück, wenn das Pattern des Bytes erst geladen werden muss.
+ */
+static uint8_t midi_sysex_read(uint8_t block, uint16_t offset, uint8_t *data)
+{
+	if(block == MIDI_SYSEX_BLOCK_PATTERNS)
+		return pattern_read(offset / sizeof(pattern_t), offset % sizeof(pattern_t), data);
+
+	*data = midi_sysex_value(block, offset);
+	return 1;
+}
+
+/**
+ * Ein Byte eines Blocks schreiben
+ *
+ * Gibt 0 zurück, wenn das Pattern des Bytes erst geladen werden muss.
+ */
+static uint8_t midi_sysex_write(uint8_t block, uint16_t offset, uint8_t data)
+{
+	switch(block)
+	{
+		case MIDI_SYSEX_BLOCK_INSTRUMENTS: {
+			// Kanal und Note werden erst mit der Note übernommen
+			if(!(offset & 1))
+			{
+				midi_sysex_lsb = data;
+				break;
+			}
+
+			midi_set_instrument(offset / 2, midi_sysex_lsb, data);
+			break;
+		}
+
+		case MIDI_SYSEX_BLOCK_PARAMETERS: {
+			// Der Wert wird erst mit dem MSB übernommen
+			if(!(offset & 1))
+			{
+				midi_sysex_lsb = data;
+				break;
+			}
+
+			uint16_t value = ((uint16_t)data << 8) | midi_sysex_lsb;
+			if(value > IO_PARAMETER_MAX)
+				value = IO_PARAMETER_MAX;
+
+			midi_control_set(offset / 2, value);
+			break;
+		}
+
+		case MIDI_SYSEX_BLOCK_PATTERNS:
+			return pattern_write(offset / sizeof(pattern_t), offset % sizeof(pattern_t), data);
+
+		case MIDI_SYSEX_BLOCK_SONG: {
+			// Pattern und Wiederholungen werden erst mit den Wiederholungen übernommen
+			if(!(offset & 1))
+			{
+				midi_sysex_lsb = data;
+				break;
+			}
+
+			song_set_entry(offset / 2, midi_sysex_lsb, data);
+			break;
+		}
+
+		case MIDI_SYSEX_BLOCK_TRACKS: {
+			uint8_t instrument = offset / MIDI_SYSEX_TRACK_SIZE;
+
+			// Multiplikator und Teiler werden erst mit dem Teiler übernommen
+			switch(offset % MIDI_SYSEX_TRACK_SIZE)
+			{
+				case 0:
+					track_set_length(instrument, data);
+					break;
+
+				case 1:
+					midi_sysex_lsb = data;
+					break;
+
+				default:
+					track_set_rate(instrument, midi_sysex_lsb, data);
+					break;
+			}
+			break;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Beginn einer SysEx-Nachricht
+ */
+void midi_sysex_receive_start(void)
+{
+	midi_sysex_rx.count = 0;
+}
+
+/*
+ * Ein Datenbyte einer SysEx-Nachricht
+ */
+void midi_sysex_receive(uint8_t data)
+{
+	uint8_t count = midi_sysex_rx.count;
+
+	// Zu lange Nachrichten fallen später bei der Längenprüfung durch
+	if(count < MIDI_SYSEX_DATA_LENGTH)
+		midi_sysex_rx.data[count] = data;
+
+	if(count != 0xFF)
+		midi_sysex_rx.count = count + 1;
+}
+
+/*
+ * Ende einer SysEx-Nachricht
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_sysex_receive_end(uint8_t complete)
+{
+	uint8_t count = midi_sysex_rx.count;
+	const uint8_t *data = midi_sysex_rx.data;
+
+	// Abgebrochene Nachrichten und Nachrichten anderer Geräte ignorieren
+	if(!complete || count < 2 || data[0] != MIDI_SYSEX_ID)
+		return;
+
+	switch(data[1])
+	{
+		case MIDI_SYSEX_REQUEST: {
+			if(count == 2)
+				midi_event_push(MIDI_SYSEX_START, MIDI_SYSEX_REQUEST, 0, TCNT1);
+			return;
+		}
+
+		case MIDI_SYSEX_DATA: {
+			// Das vorherige Stück ist noch nicht verarbeitet
+			if(midi_sysex_mailbox.full)
+			{
+				midi_sysex_rejects++;
+				return;
+			}
+
+			midi_sysex_mailbox.block = data[2];
+			midi_sysex_mailbox.chunk = data[3];
+
+			if(count != MIDI_SYSEX_DATA_LENGTH || midi_sysex_crc_block(data + 1, MIDI_SYSEX_DATA_LENGTH - 2) != data[MIDI_SYSEX_DATA_LENGTH - 1])
+			{
+				midi_sysex_rejects++;
+				midi_sysex_mailbox.status = MIDI_SYSEX_ERROR_CRC;
+			}
+			else
+			{
+				// 7-in-8 entpacken
+				uint8_t msbs = data[4];
+				for(uint8_t i = 0; i < MIDI_SYSEX_CHUNK_SIZE; i++, msbs >>= 1)
+					midi_sysex_mailbox.data[i] = data[5 + i] | ((msbs & 1) << 7);
+
+				midi_sysex_mailbox.status = MIDI_SYSEX_OK;
+			}
+
+			midi_sysex_mailbox.full = 1;
+			midi_event_push(MIDI_SYSEX_START, MIDI_SYSEX_DATA, 0, TCNT1);
+			return;
+		}
+	}
+}
+
+/**
+ * Ein empfangenes Stück übernehmen und quittieren
+ */
+static void midi_sysex_apply(void)
+{
+	uint8_t block = midi_sysex_mailbox.block;
+	uint8_t chunk = midi_sysex_mailbox.chunk;
+	uint8_t status = midi_sysex_mailbox.status;
+
+	uint16_t size = midi_sysex_block_size(block);
+	uint16_t offset = (uint16_t)chunk * MIDI_SYSEX_CHUNK_SIZE;
+
+	if(status == MIDI_SYSEX_OK && offset >= size)
+		status = MIDI_SYSEX_ERROR_RANGE;
+
+	if(status == MIDI_SYSEX_OK)
+	{
+		// Klingende Noten mit der alten Zuordnung beenden
+		if(block == MIDI_SYSEX_BLOCK_INSTRUMENTS)
+			midi_detrigger_instruments();
+
+		for(uint8_t i = midi_sysex_mailbox.applied; i < MIDI_SYSEX_CHUNK_SIZE && offset + i < size; i++)
+		{
+			// Das Pattern wird erst geladen, midi_sysex_poll macht hier weiter
+			if(!midi_sysex_write(block, offset + i, midi_sysex_mailbox.data[i]))
+			{
+				midi_sysex_mailbox.applied = i;
+				midi_sysex_mailbox.waiting = 1;
+				return;
+			}
+		}
+
+		// Die geladene Zuordnung und der Song überdauern das Ausschalten
+		if(block == MIDI_SYSEX_BLOCK_INSTRUMENTS)
+			midi_save_instruments();
+		else if(block == MIDI_SYSEX_BLOCK_SONG)
+			song_save();
+	}
+
+	// Postfach für das nächste Stück freigeben
+	midi_sysex_mailbox.applied = 0;
+	midi_sysex_mailbox.waiting = 0;
+	midi_sysex_mailbox.full = 0;
+
+	uint8_t ack[] = {MIDI_SYSEX_START, MIDI_SYSEX_ID, MIDI_SYSEX_ACK, block & 0x7F, chunk & 0x7F, status, MIDI_SYSEX_END};
+	midi_send_message(ack, sizeof(ack));
+}
+
+/*
+ * Ein SysEx-Ereignis im Hauptprogramm verarbeiten
+ */
+void midi_sysex_dispatch(uint8_t type)
+{
+	if(type == MIDI_SYSEX_REQUEST)
+		midi_sysex_dump();
+	else if(type == MIDI_SYSEX_DATA)
+		midi_sysex_apply();
+}
+
+/*
+ * Einen Dump aller Blöcke starten
+ */
+void midi_sysex_dump(void)
+{
+	midi_sysex_dump_state.active = 1;
+	midi_sysex_dump_state.allowance = 1;
+	midi_sysex_dump_state.block = 0;
+	midi_sysex_dump_state.chunk = 0;
+	midi_sysex_dump_state.filled = 0;
+}
+
+/*
+ * Einen Step melden
+ */
+void midi_sysex_step(void)
+{
+	midi_sysex_dump_state.allowance = 1;
+}
+
+/*
+ * Einen laufenden Dump weitersenden
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_sysex_poll(uint8_t paused)
+{
+	// Ein Stück, das auf ein Pattern wartet, weiter übernehmen
+	if(midi_sysex_mailbox.waiting)
+		midi_sysex_apply();
+
+	if(!midi_sysex_dump_state.active || (!paused && !midi_sysex_dump_state.allowance))
+		return;
+
+	// Nur ganze Nachrichten einreihen
+	if(midi_tx_free(MIDI_TX_SYSEX) < MIDI_SYSEX_MESSAGE_LENGTH)
+		return;
+
+	uint8_t block = midi_sysex_dump_state.block;
+	uint16_t size = midi_sysex_block_size(block);
+	uint16_t offset = (uint16_t)midi_sysex_dump_state.chunk * MIDI_SYSEX_CHUNK_SIZE;
+
+	// Block fertig oder leer: zum nächsten Block
+	if(offset >= size)
+	{
+		midi_sysex_dump_state.chunk = 0;
+
+		if(++midi_sysex_dump_state.block == N_MIDI_SYSEX_BLOCKS)
+		{
+			uint8_t done[] = {MIDI_SYSEX_START, MIDI_SYSEX_ID, MIDI_SYSEX_DONE, MIDI_SYSEX_END};
+			midi_send_message(done, sizeof(done));
+			midi_sysex_dump_state.active = 0;
+		}
+
+		return;
+	}
+
+	// Die Bytes des Stücks sammeln, hinter dem Ende des Blocks mit 0 auffüllen.
+	// Muss ein Pattern erst geladen werden, geht es beim nächsten Aufruf weiter.
+	for(uint8_t i = midi_sysex_dump_state.filled; i < MIDI_SYSEX_CHUNK_SIZE; i++)
+	{
+		uint8_t *data = &midi_sysex_dump_state.data[i];
+
+		if(offset + i >= size)
+			*data = 0;
+		else if(!midi_sysex_read(block, offset + i, data))
+			return;
+
+		midi_sysex_dump_state.filled = i + 1;
+	}
+
+	uint8_t message[MIDI_SYSEX_MESSAGE_LENGTH] = {
+		MIDI_SYSEX_START, MIDI_SYSEX_ID, MIDI_SYSEX_DATA, block, midi_sysex_dump_state.chunk, 0
+	};
+
+	// 7-in-8 packen
+	for(uint8_t i = 0; i < MIDI_SYSEX_CHUNK_SIZE; i++)
+	{
+		uint8_t data = midi_sysex_dump_state.data[i];
+
+		message[5] |= (data >> 7) << i;
+		message[6 + i] = data & 0x7F;
+	}
+
+	message[MIDI_SYSEX_MESSAGE_LENGTH - 2] = midi_sysex_crc_block(message + 2, MIDI_SYSEX_DATA_LENGTH - 2);
+	message[MIDI_SYSEX_MESSAGE_LENGTH - 1] = MIDI_SYSEX_END;
+
+	midi_send_message(message, sizeof(message));
+
+	midi_sysex_dump_state.chunk++;
+	midi_sysex_dump_state.filled = 0;
+	midi_sysex_dump_state.allowance = 0;
+}
+
+/*
+ * Anzahl der verworfenen Stücke
+ */
+uint16_t midi_sysex_rejected(void)
+{
+	uint16_t rejects;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		rejects = midi_sysex_rejects;
+	}
+
+	return rejects;
+}
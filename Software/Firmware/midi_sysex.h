@@ -0,0 +1,193 @@
+/**
+ * @file
+ * Sichern und Laden der Einstellungen per SysEx, externes Interface
+ *
+ * Die Daten sind in Blöcke aufgeteilt (z.B. die Noten der Instrumente oder die
+ * Werte der Parameter), jeder Block wird in Stücke zu MIDI_SYSEX_CHUNK_SIZE
+ * Bytes übertragen. Jedes Stück ist eine eigene, kurze SysEx-Nachricht:
+ *
+ *     F0 7D <Kommando> <Block> <Stück> <8 Datenbytes> <CRC> F7
+ *
+ * 0x7D ist die Hersteller-Kennung für nicht-kommerzielle Geräte. Die 7 Bytes
+ * eines Stücks werden 7-in-8 gepackt: das erste Datenbyte enthält die
+ * obersten Bits der folgenden 7 Bytes (Bit n gehört zu Byte n), diese folgen
+ * mit gelöschtem obersten Bit. Die CRC ist eine CRC-7 (Polynom x^7 + x^3 + 1,
+ * Startwert 0) über Kommando, Block, Stück und die 8 gepackten Datenbytes.
+ *
+ * Ein Dump wird mit "F0 7D 01 F7" angefordert. Die Microdrum sendet dann alle
+ * Blöcke als MIDI_SYSEX_DATA-Nachrichten, höchstens ein Stück pro Step, damit
+ * die Trigger nie lange hinter einer SysEx-Nachricht warten müssen. Bei
+ * angehaltener Clock wird ohne Pause gesendet. Zum Abschluss folgt
+ * "F0 7D 03 F7".
+ *
+ * Zum Laden schickt der Host dieselben MIDI_SYSEX_DATA-Nachrichten, jedes Stück
+ * wird mit "F0 7D 04 <Block> <Stück> <Status> F7" quittiert. Der Host muss die
+ * Quittung abwarten, bevor er das nächste Stück sendet, und schickt die Stücke
+ * eines Blocks in aufsteigender Reihenfolge. Empfangen wird byteweise im
+ * Empfangs-Interrupt in einen Puffer von der Größe eines Stücks, ein ganzer
+ * Dump muss also nie in den RAM passen.
+ */
+
+#ifndef MIDI_SYSEX_H_
+#define MIDI_SYSEX_H_
+
+#include <stdint.h>
+
+#include "pattern.h"
+
+/**
+ * Hersteller-Kennung für nicht-kommerzielle Geräte
+ */
+#define MIDI_SYSEX_ID 0x7D
+
+/**
+ * Kommando: Dump anfordern
+ */
+#define MIDI_SYSEX_REQUEST 0x01
+
+/**
+ * Kommando: ein Stück eines Blocks
+ */
+#define MIDI_SYSEX_DATA 0x02
+
+/**
+ * Kommando: Ende eines Dumps
+ */
+#define MIDI_SYSEX_DONE 0x03
+
+/**
+ * Kommando: Quittung eines geladenen Stücks
+ */
+#define MIDI_SYSEX_ACK 0x04
+
+/**
+ * Quittungs-Status: Stück übernommen
+ */
+#define MIDI_SYSEX_OK 0
+
+/**
+ * Quittungs-Status: CRC oder Länge falsch
+ */
+#define MIDI_SYSEX_ERROR_CRC 1
+
+/**
+ * Quittungs-Status: Block oder Stück existiert nicht
+ */
+#define MIDI_SYSEX_ERROR_RANGE 2
+
+/**
+ * Anzahl der Nutzdaten-Bytes pro Stück
+ */
+#define MIDI_SYSEX_CHUNK_SIZE 7
+
+/**
+ * Block: Zuordnung der Instrumente (Midi-Kanal und Note pro Instrument)
+ *
+ * Wird nach jedem geladenen Stück im EEPROM gesichert.
+ */
+#define MIDI_SYSEX_BLOCK_INSTRUMENTS 0
+
+/**
+ * Block: Werte der Parameter (zwei Bytes pro Parameter, LSB zuerst)
+ */
+#define MIDI_SYSEX_BLOCK_PARAMETERS 1
+
+/**
+ * Block: Patterns (sizeof(pattern_t) Bytes pro Pattern in dessen Darstellung)
+ */
+#define MIDI_SYSEX_BLOCK_PATTERNS 2
+
+/**
+ * Block: Fehler- und Überlauf-Zähler (zwei Bytes pro Zähler, LSB zuerst)
+ *
+ * Nur zum Auslesen, beim Laden wird der Inhalt ignoriert. Reihenfolge der
+ * Zähler: Framing-Fehler, Überläufe und Paritätsfehler des Empfangs, verlorene
+ * Ereignisse, Überläufe der Sende-Warteschlangen, nicht weitergeleitete
+ * Nachrichten, verworfene SysEx-Stücke, ausstehende EEPROM-Schreibaufträge,
+ * geschriebene EEPROM-Bytes, danach die Schreibvorgänge jedes
+ * Pattern-Speicherplatzes.
+ */
+#define MIDI_SYSEX_BLOCK_STATISTICS 3
+
+/**
+ * Anzahl der Zähler im Block MIDI_SYSEX_BLOCK_STATISTICS
+ */
+#define N_MIDI_SYSEX_STATISTICS (9 + PATTERN_N_SLOTS)
+
+/**
+ * Block: Song (Pattern und Wiederholungen pro Eintrag)
+ *
+ * Wird nach jedem geladenen Stück im EEPROM gesichert.
+ */
+#define MIDI_SYSEX_BLOCK_SONG 4
+
+/**
+ * Block: Spuren (Länge, Multiplikator und Teiler des Tempos pro Instrument)
+ *
+ * Wird nicht gesichert.
+ */
+#define MIDI_SYSEX_BLOCK_TRACKS 5
+
+/**
+ * Anzahl der Bytes pro Spur im Block MIDI_SYSEX_BLOCK_TRACKS
+ */
+#define MIDI_SYSEX_TRACK_SIZE 3
+
+/**
+ * Anzahl der Blöcke
+ */
+#define N_MIDI_SYSEX_BLOCKS 6
+
+/**
+ * Beginn einer SysEx-Nachricht im Empfangs-Interrupt melden
+ */
+void midi_sysex_receive_start(void);
+
+/**
+ * Ein Datenbyte einer SysEx-Nachricht im Empfangs-Interrupt übergeben
+ */
+void midi_sysex_receive(uint8_t data);
+
+/**
+ * Ende einer SysEx-Nachricht im Empfangs-Interrupt melden
+ *
+ * complete ist 0, wenn die Nachricht nicht mit 0xF7, sondern durch ein anderes
+ * Status-Byte beendet wurde. Eine vollständige und gültige Nachricht wird über
+ * die Ereignis-Warteschlange an midi_sysex_dispatch übergeben.
+ */
+void midi_sysex_receive_end(uint8_t complete);
+
+/**
+ * Ein vom Empfangs-Interrupt gemeldetes SysEx-Ereignis im Hauptprogramm
+ * verarbeiten
+ *
+ * type ist MIDI_SYSEX_REQUEST oder MIDI_SYSEX_DATA.
+ */
+void midi_sysex_dispatch(uint8_t type);
+
+/**
+ * Einen Dump aller Blöcke starten
+ */
+void midi_sysex_dump(void);
+
+/**
+ * Einen Step melden: erlaubt das Senden des nächsten Stücks eines Dumps
+ */
+void midi_sysex_step(void);
+
+/**
+ * Einen laufenden Dump weitersenden
+ *
+ * Wird von midi_dispatch aufgerufen. paused ist 1, solange die Clock steht,
+ * dann wird ohne Rücksicht auf die Steps gesendet. Übernimmt außerdem ein
+ * empfangenes Stück weiter, das auf das Laden eines Patterns gewartet hat.
+ */
+void midi_sysex_poll(uint8_t paused);
+
+/**
+ * Anzahl der empfangenen Stücke, die wegen eines Fehlers oder weil das
+ * vorherige Stück noch nicht verarbeitet war, verworfen wurden
+ */
+uint16_t midi_sysex_rejected(void);
+
+#endif /* MIDI_SYSEX_H_ */
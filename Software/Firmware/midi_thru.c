@@ -0,0 +1,166 @@
+/**
+ * @file
+ * Weiterleiten der empfangenen Midi-Nachrichten an den Ausgang
+ */
+
+#include <stdint.h>
+#include <util/atomic.h>
+
+#include "midi.h"
+#include "midi_thru.h"
+#include "timer.h"
+#include "clock.h"
+
+/**
+ * Zustand der Weiterleitung
+ */
+struct {
+	// Kombination der MIDI_THRU_*-Bits
+	volatile uint8_t filter;
+
+	// Anzahl der weitergeleiteten Nachrichten
+	uint16_t forwarded;
+
+	// Anzahl der wegen einer vollen Warteschlange verworfenen Nachrichten
+	uint16_t dropped;
+} midi_thru = {
+	.filter = MIDI_THRU_DEFAULT
+};
+
+/**
+ * Das Filter-Bit zu einem Status-Byte bestimmen, 0 für nie weitergeleitete
+ * Nachrichten
+ */
+static uint8_t midi_thru_category(uint8_t status)
+{
+	switch(status & 0xF0)
+	{
+		case 0x80:
+		case 0x90:
+		case 0xA0:
+			return MIDI_THRU_NOTES;
+
+		case 0xB0:
+			return MIDI_THRU_CONTROL;
+
+		case 0xC0:
+			return MIDI_THRU_PROGRAM;
+
+		case 0xD0:
+		case 0xE0:
+			return MIDI_THRU_PITCH;
+	}
+
+	switch(status)
+	{
+		case MIDI_CLOCK:
+			return MIDI_THRU_CLOCK;
+
+		case MIDI_START:
+		case MIDI_STOP:
+		case MIDI_CONTINUE:
+			return MIDI_THRU_TRANSPORT;
+
+		case 0xFE:
+		case 0xFF:
+			return MIDI_THRU_SENSING;
+
+		// SysEx und die undefinierten Bytes
+		case MIDI_SYSEX_START:
+		case MIDI_SYSEX_END:
+		case 0xF4:
+		case 0xF5:
+		case 0xF9:
+		case 0xFD:
+			return 0;
+	}
+
+	return MIDI_THRU_COMMON;
+}
+
+/*
+ * Den Filter setzen
+ */
+void midi_thru_set_filter(uint8_t filter)
+{
+	midi_thru.filter = filter;
+}
+
+/*
+ * Der aktuelle Filter
+ */
+uint8_t midi_thru_get_filter(void)
+{
+	return midi_thru.filter;
+}
+
+/*
+ * Eine vollständig empfangene Nachricht weiterleiten
+ * siehe Header-Datie für mehr Informationen
+ */
+void midi_thru_forward(uint8_t status, const uint8_t *data, uint8_t length, uint16_t timestamp)
+{
+	uint8_t category = midi_thru_category(status);
+
+	if(!(category & midi_thru.filter))
+		return;
+
+	// Der interne Taktgeber sendet selbst Clock und Transport
+	if((category & (MIDI_THRU_CLOCK | MIDI_THRU_TRANSPORT)) && clock_get_source() == CLOCK_SOURCE_INTERNAL)
+		return;
+
+	uint8_t message[3] = {status};
+	for(uint8_t i = 0; i < length; i++)
+		message[i + 1] = data[i];
+
+	if(midi_send_thru(message, length + 1, timestamp))
+		midi_thru.forwarded++;
+	else
+		midi_thru.dropped++;
+}
+
+/*
+ * Anzahl der weitergeleiteten Nachrichten
+ */
+uint16_t midi_thru_forwarded(void)
+{
+	uint16_t forwarded;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		forwarded = midi_thru.forwarded;
+	}
+
+	return forwarded;
+}
+
+/*
+ * Anzahl der nicht weitergeleiteten Nachrichten
+ */
+uint16_t midi_thru_dropped(void)
+{
+	uint16_t dropped;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		dropped = midi_thru.dropped;
+	}
+
+	return dropped;
+}
+
+/*
+ * Größte gemessene Weiterleitungs-Latenz in CPU-Takten
+ */
+uint32_t midi_thru_latency_max(void)
+{
+	return (uint32_t)midi_tx_thru_latency_max() * TIMER_PRESCALE;
+}
+
+/*
+ * Mittlere Weiterleitungs-Latenz in CPU-Takten
+ */
+uint32_t midi_thru_latency_mean(void)
+{
+	return (uint32_t)midi_tx_thru_latency_mean() * TIMER_PRESCALE;
+}
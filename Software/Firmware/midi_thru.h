@@ -0,0 +1,122 @@
+/**
+ * @file
+ * Weiterleiten der empfangenen Midi-Nachrichten an den Ausgang, externes Interface
+ *
+ * Die Microdrum mischt die empfangenen Nachrichten in ihre eigene Ausgabe, so
+ * dass ein weiterer Synthesizer ohne externe Merge-Box hinter ihr hängen kann.
+ * Channel- und System-Common-Nachrichten werden erst weitergeleitet, wenn sie
+ * vollständig empfangen wurden, und landen als ganze Nachricht in der
+ * Warteschlange ihrer Prioritätsklasse. So können sie die eigenen Noten und
+ * Control-Changes nie zerreißen. Realtime-Bytes werden noch im
+ * Empfangs-Interrupt weitergereicht und gehen vor allen anderen Bytes raus.
+ *
+ * SysEx-Nachrichten werden nicht weitergeleitet, weil sie die Ausgabe für
+ * unbestimmte Zeit belegen würden.
+ */
+
+#ifndef MIDI_THRU_H_
+#define MIDI_THRU_H_
+
+#include <stdint.h>
+
+/**
+ * Filter-Bit: NoteOn, NoteOff und Polyphonic Aftertouch weiterleiten
+ */
+#define MIDI_THRU_NOTES 0x01
+
+/**
+ * Filter-Bit: Control-Changes weiterleiten
+ */
+#define MIDI_THRU_CONTROL 0x02
+
+/**
+ * Filter-Bit: Program-Changes weiterleiten
+ */
+#define MIDI_THRU_PROGRAM 0x04
+
+/**
+ * Filter-Bit: Channel Aftertouch und Pitch-Bend weiterleiten
+ */
+#define MIDI_THRU_PITCH 0x08
+
+/**
+ * Filter-Bit: System-Common-Nachrichten (0xF1-0xF6) weiterleiten, z.B. SPP
+ */
+#define MIDI_THRU_COMMON 0x10
+
+/**
+ * Filter-Bit: Midi-Clock weiterleiten
+ */
+#define MIDI_THRU_CLOCK 0x20
+
+/**
+ * Filter-Bit: Start, Stop und Continue weiterleiten
+ */
+#define MIDI_THRU_TRANSPORT 0x40
+
+/**
+ * Filter-Bit: Active-Sensing und System-Reset weiterleiten
+ */
+#define MIDI_THRU_SENSING 0x80
+
+/**
+ * Filter nach dem Einschalten: alles außer Active-Sensing und System-Reset
+ */
+#define MIDI_THRU_DEFAULT 0x7F
+
+/**
+ * Den Filter setzen
+ *
+ * filter ist eine Kombination der MIDI_THRU_*-Bits, 0 schaltet das
+ * Weiterleiten ab.
+ */
+void midi_thru_set_filter(uint8_t filter);
+
+/**
+ * Der aktuelle Filter
+ *
+ * @see midi_thru_set_filter
+ */
+uint8_t midi_thru_get_filter(void);
+
+/**
+ * Eine vollständig empfangene Nachricht weiterleiten, wenn der Filter sie zulässt
+ *
+ * data zeigt auf die length Datenbytes hinter dem Status-Byte. timestamp ist
+ * der Timer1-Zählerstand beim Empfang. Wird aus dem Empfangs-Interrupt
+ * aufgerufen.
+ *
+ * Solange der interne Taktgeber aktiv ist, werden empfangene Clock- und
+ * Transport-Nachrichten nicht weitergeleitet, damit am Ausgang nicht zwei
+ * Clocks durcheinander laufen.
+ */
+void midi_thru_forward(uint8_t status, const uint8_t *data, uint8_t length, uint16_t timestamp);
+
+/**
+ * Anzahl der weitergeleiteten Nachrichten
+ */
+uint16_t midi_thru_forwarded(void);
+
+/**
+ * Anzahl der Nachrichten, die wegen einer vollen Warteschlange nicht
+ * weitergeleitet werden konnten
+ */
+uint16_t midi_thru_dropped(void);
+
+/**
+ * Größte gemessene Zeit vom Empfang bis zum Senden einer weitergeleiteten
+ * Nachricht in CPU-Takten
+ *
+ * Die Auflösung ist ein Timer-Tick, also TIMER_PRESCALE Takte.
+ */
+uint32_t midi_thru_latency_max(void);
+
+/**
+ * Mittlere Zeit vom Empfang bis zum Senden einer weitergeleiteten Nachricht
+ * in CPU-Takten
+ *
+ * @see midi_thru_latency_max
+ */
+uint32_t midi_thru_latency_mean(void);
+
+#endif /* MIDI_THRU_H_ */
@@ -0,0 +1,512 @@
+/**
+ * @file
+ * Midi-Ausgabe mit Prioritätsklassen
+ *
+ * Jede Klasse hat einen eigenen Ringpuffer. head wird nur beim Einfügen (immer
+ * atomar) geschrieben, tail nur vom UDRE-Interrupt. Da die Nachrichten immer
+ * vollständig eingefügt werden, beginnt an jedem Status-Byte in einer
+ * Warteschlange eine neue Nachricht: das ist die Stelle, an der eine höhere
+ * Klasse zum Zug kommen darf.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "bits.h"
+#include "midi.h"
+#include "midi_tx.h"
+
+/**
+ * Kennzeichnet, dass gerade keine Nachricht gesendet wird
+ */
+#define MIDI_TX_NONE 0xFF
+
+/**
+ * Ringpuffer einer Prioritätsklasse
+ */
+typedef struct {
+	/// Zu sendende Bytes
+	uint8_t data[MIDI_TX_BUFFER_SIZE];
+
+	/// Schreib-Index (nächster freier Platz)
+	volatile uint8_t head;
+
+	/// Lese-Index (nächstes zu sendendes Byte)
+	volatile uint8_t tail;
+} midi_tx_queue_t;
+
+/**
+ * Wartezeit-Messung einer Prioritätsklasse
+ */
+typedef struct {
+	/// Timer1-Zählerstand beim Einreihen der gemessenen Nachricht
+	uint16_t stamp;
+
+	/// Position des ersten Bytes der gemessenen Nachricht
+	uint8_t index;
+
+	/// 1, solange eine Nachricht in Messung ist
+	uint8_t pending;
+
+	/// Größte gemessene Wartezeit
+	uint16_t max;
+
+	/// Gleitender Mittelwert der Wartezeit
+	uint16_t mean;
+} midi_tx_latency_t;
+
+/**
+ * Zustand der Midi-Ausgabe
+ */
+struct {
+	/// Warteschlangen der Prioritätsklassen
+	midi_tx_queue_t queues[N_MIDI_TX_CLASSES];
+
+	/// Wartezeit-Messung der Prioritätsklassen
+	midi_tx_latency_t latency[N_MIDI_TX_CLASSES];
+
+	/// Wartezeit-Messung der weitergeleiteten Nachrichten
+	midi_tx_latency_t thru;
+
+	/// Klasse der gerade gemessenen weitergeleiteten Nachricht
+	uint8_t thru_class;
+
+	/// Klasse der gerade gesendeten Nachricht oder MIDI_TX_NONE
+	uint8_t current;
+
+	/// 1, solange eine SysEx-Nachricht auf der Leitung auf ihr 0xF7 wartet
+	uint8_t sysex;
+
+	/// Zuletzt gesendetes Channel-Status-Byte, 0 wenn keins gültig ist
+	uint8_t running_status;
+
+	/// Höchster bisher erreichter Füllstand aller Warteschlangen
+	uint8_t high_water;
+
+	/// Anzahl der wegen Platzmangel verworfenen Nachrichten
+	uint16_t overflows;
+
+	/// 1, sobald ein Byte gesendet wurde, wird von midi_tx_sent gelöscht
+	volatile uint8_t sent;
+} midi_tx;
+
+/*
+ * Die Sende-Warteschlangen leeren
+ */
+void midi_tx_init(void)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		memset((void*)&midi_tx, 0, sizeof(midi_tx));
+		midi_tx.current = MIDI_TX_NONE;
+	}
+}
+
+/**
+ * Füllstand der Warteschlange einer Klasse
+ */
+static uint8_t midi_tx_used(uint8_t class)
+{
+	return (midi_tx.queues[class].head - midi_tx.queues[class].tail) & (MIDI_TX_BUFFER_SIZE - 1);
+}
+
+/**
+ * Die Prioritätsklasse einer Nachricht anhand ihres ersten Bytes bestimmen
+ */
+static uint8_t midi_tx_class(const uint8_t *data, uint8_t length)
+{
+	uint8_t status = data[0];
+
+	// Fortsetzung einer SysEx-Nachricht
+	if(status < 0x80)
+		return MIDI_TX_SYSEX;
+
+	if(status >= 0xF8)
+		return MIDI_TX_REALTIME;
+
+	if(status >= 0xF0)
+		return (status == MIDI_SYSEX_START || status == MIDI_SYSEX_END) ? MIDI_TX_SYSEX : MIDI_TX_CONTROL;
+
+	switch(status & 0xF0)
+	{
+		case MIDI_NOTEON:
+			return (length > 2 && data[2] == 0) ? MIDI_TX_NOTEOFF : MIDI_TX_NOTEON;
+
+		case MIDI_NOTEOFF:
+			return MIDI_TX_NOTEOFF;
+
+		default:
+			return MIDI_TX_CONTROL;
+	}
+}
+
+/**
+ * Gibt 1 zurück, wenn in der NoteOff-Warteschlange noch eine Nachricht für
+ * dieselbe Taste (Kanal und Note) auf das Senden wartet
+ *
+ * Jedes Status-Byte in der Warteschlange beginnt eine Nachricht, das Byte
+ * dahinter ist ihre Note.
+ */
+static uint8_t midi_tx_note_queued(uint8_t channel, uint8_t note)
+{
+	midi_tx_queue_t *queue = &midi_tx.queues[MIDI_TX_NOTEOFF];
+
+	for(uint8_t i = queue->tail; i != queue->head; i = (i + 1) & (MIDI_TX_BUFFER_SIZE - 1))
+	{
+		if(queue->data[i] >= 0x80 && (queue->data[i] & 0x0F) == channel && queue->data[(i + 1) & (MIDI_TX_BUFFER_SIZE - 1)] == note)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Anzahl der freien Bytes in der Warteschlange einer Klasse
+ */
+uint8_t midi_tx_free(uint8_t class)
+{
+	// ein Platz bleibt immer frei, um voll und leer unterscheiden zu können
+	return (MIDI_TX_BUFFER_SIZE - 1) - midi_tx_used(class);
+}
+
+/*
+ * Anzahl der noch nicht gesendeten Bytes in der Warteschlange einer Klasse
+ */
+uint8_t midi_tx_pending(uint8_t class)
+{
+	return midi_tx_used(class);
+}
+
+/**
+ * Eine Wartezeit-Messung beginnen, wenn gerade keine läuft
+ */
+static void midi_tx_stamp(midi_tx_latency_t *latency, uint8_t index, uint16_t stamp)
+{
+	if(latency->pending)
+		return;
+
+	latency->pending = 1;
+	latency->index = index;
+	latency->stamp = stamp;
+}
+
+/**
+ * Eine Wartezeit-Messung abschließen
+ */
+static void midi_tx_measure(midi_tx_latency_t *latency)
+{
+	uint16_t wait = TCNT1 - latency->stamp;
+
+	if(wait > latency->max)
+		latency->max = wait;
+
+	latency->mean = latency->mean - latency->mean / 8 + wait / 8;
+	latency->pending = 0;
+}
+
+/**
+ * Eine komplette Midi-Nachricht in die Warteschlange ihrer Klasse legen
+ *
+ * thru kennzeichnet eine weitergeleitete Nachricht, deren Wartezeit ab dem
+ * Empfangszeitpunkt stamp gemessen wird.
+ */
+static uint8_t midi_tx_enqueue(const uint8_t *data, uint8_t length, uint8_t thru, uint16_t stamp)
+{
+	uint8_t class = midi_tx_class(data, length);
+
+	// Das Einfügen kann sowohl aus dem Hauptprogramm als auch aus Interrupts
+	// heraus passieren, darum darf es nicht unterbrochen werden
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		// Ein NoteOn darf ein älteres NoteOff derselben Taste nicht überholen,
+		// sonst beendet das NoteOff den neuen Anschlag. Es reiht sich darum
+		// hinter diesem in die NoteOff-Warteschlange ein.
+		if(class == MIDI_TX_NOTEON && midi_tx_note_queued(data[0] & 0x0F, data[1]))
+			class = MIDI_TX_NOTEOFF;
+
+		midi_tx_queue_t *queue = &midi_tx.queues[class];
+
+		// Passt die Nachricht nicht mehr komplett hinein, wird sie verworfen
+		if(midi_tx_free(class) < length)
+		{
+			midi_tx.overflows++;
+			return 0;
+		}
+
+		uint8_t head = queue->head;
+
+		// Ist in dieser Klasse gerade keine Nachricht in Messung, wird diese gemessen
+		if(data[0] >= 0x80)
+			midi_tx_stamp(&midi_tx.latency[class], head, TCNT1);
+
+		// ebenso bei den weitergeleiteten Nachrichten
+		if(thru && !midi_tx.thru.pending)
+		{
+			midi_tx.thru_class = class;
+			midi_tx_stamp(&midi_tx.thru, head, stamp);
+		}
+
+		while(length--)
+		{
+			queue->data[head] = *data++;
+			head = (head + 1) & (MIDI_TX_BUFFER_SIZE - 1);
+		}
+		queue->head = head;
+
+		// Füllstands-Statistik nachführen
+		uint8_t used = 0;
+		for(uint8_t i = 0; i < N_MIDI_TX_CLASSES; i++)
+			used += midi_tx_used(i);
+
+		if(used > midi_tx.high_water)
+			midi_tx.high_water = used;
+
+		// Den Sende-Interrupt aktivieren, er schaltet sich selbst wieder ab,
+		// wenn nichts mehr zu senden ist
+		SETBIT(UCSRB, UDRIE);
+	}
+
+	return 1;
+}
+
+/*
+ * Eine komplette Midi-Nachricht in die Warteschlange ihrer Klasse legen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t midi_send_message(const uint8_t *data, uint8_t length)
+{
+	return midi_tx_enqueue(data, length, 0, 0);
+}
+
+/*
+ * Eine empfangene Nachricht weiterleiten
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t midi_send_thru(const uint8_t *data, uint8_t length, uint16_t timestamp)
+{
+	return midi_tx_enqueue(data, length, 1, timestamp);
+}
+
+/*
+ * Eine Channel-Voice-Nachricht mit zwei Datenbytes senden
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t midi_send_voice(uint8_t status, uint8_t data1, uint8_t data2)
+{
+	uint8_t message[3] = {status, data1 & 0x7F, data2 & 0x7F};
+
+	return midi_send_message(message, 3);
+}
+
+/*
+ * Ein Byte zum Senden in die Warteschlange seiner Klasse legen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t midi_send(uint8_t data)
+{
+	return midi_send_message(&data, 1);
+}
+
+/*
+ * Höchster bisher erreichter Füllstand aller Warteschlangen
+ */
+uint8_t midi_tx_high_water(void)
+{
+	return midi_tx.high_water;
+}
+
+/*
+ * Gibt 1 zurück, wenn seit dem letzten Aufruf ein Byte gesendet wurde
+ */
+uint8_t midi_tx_sent(void)
+{
+	uint8_t sent;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		sent = midi_tx.sent;
+		midi_tx.sent = 0;
+	}
+
+	return sent;
+}
+
+/*
+ * Anzahl der wegen einer vollen Warteschlange verworfenen Nachrichten
+ */
+uint16_t midi_tx_overflows(void)
+{
+	uint16_t overflows;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		overflows = midi_tx.overflows;
+	}
+
+	return overflows;
+}
+
+/*
+ * Größte gemessene Wartezeit einer Nachricht der Klasse
+ */
+uint16_t midi_tx_latency_max(uint8_t class)
+{
+	uint16_t max;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		max = midi_tx.latency[class].max;
+	}
+
+	return max;
+}
+
+/*
+ * Mittlere Wartezeit einer Nachricht der Klasse
+ */
+uint16_t midi_tx_latency_mean(uint8_t class)
+{
+	uint16_t mean;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mean = midi_tx.latency[class].mean;
+	}
+
+	return mean;
+}
+
+/*
+ * Größte gemessene Wartezeit einer weitergeleiteten Nachricht
+ */
+uint16_t midi_tx_thru_latency_max(void)
+{
+	uint16_t max;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		max = midi_tx.thru.max;
+	}
+
+	return max;
+}
+
+/*
+ * Mittlere Wartezeit einer weitergeleiteten Nachricht
+ */
+uint16_t midi_tx_thru_latency_mean(void)
+{
+	uint16_t mean;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		mean = midi_tx.thru.mean;
+	}
+
+	return mean;
+}
+
+/**
+ * Das nächste Byte aus der Warteschlange einer Klasse entnehmen
+ *
+ * Wird nur aus dem UDRE-Interrupt aufgerufen. Beendet die Wartezeit-Messung,
+ * wenn das erste Byte der gemessenen Nachricht an der Reihe ist.
+ */
+static uint8_t midi_tx_take(uint8_t class)
+{
+	midi_tx_queue_t *queue = &midi_tx.queues[class];
+	midi_tx_latency_t *latency = &midi_tx.latency[class];
+	uint8_t tail = queue->tail;
+
+	if(latency->pending && latency->index == tail)
+		midi_tx_measure(latency);
+
+	if(midi_tx.thru.pending && midi_tx.thru_class == class && midi_tx.thru.index == tail)
+		midi_tx_measure(&midi_tx.thru);
+
+	uint8_t data = queue->data[tail];
+	queue->tail = (tail + 1) & (MIDI_TX_BUFFER_SIZE - 1);
+
+	return data;
+}
+
+/**
+ * UART Sende-Interrupt: der UART kann das nächste Byte aufnehmen
+ */
+ISR(USART_UDRE_vect)
+{
+	// Realtime-Bytes dürfen jederzeit gesendet werden, auch mitten in einer Nachricht
+	if(midi_tx_used(MIDI_TX_REALTIME))
+	{
+		UDR = midi_tx_take(MIDI_TX_REALTIME);
+		midi_tx.sent = 1;
+		return;
+	}
+
+	uint8_t class = midi_tx.current;
+
+	if(class != MIDI_TX_NONE)
+	{
+		if(!midi_tx_used(class))
+		{
+			// Eine offene SysEx-Nachricht darf nur durch Realtime-Bytes
+			// unterbrochen werden, bis ihre Fortsetzung eingereiht wird
+			if(midi_tx.sysex)
+			{
+				CLEARBIT(UCSRB, UDRIE);
+				return;
+			}
+
+			class = MIDI_TX_NONE;
+		}
+		else if(!midi_tx.sysex && midi_tx.queues[class].data[midi_tx.queues[class].tail] >= 0x80)
+		{
+			// Die laufende Nachricht ist komplett, nächste Nachrichtengrenze
+			class = MIDI_TX_NONE;
+		}
+	}
+
+	// An einer Nachrichtengrenze kommt die höchste nicht-leere Klasse zum Zug
+	if(class == MIDI_TX_NONE)
+	{
+		for(class = MIDI_TX_REALTIME + 1; class < N_MIDI_TX_CLASSES; class++)
+		{
+			if(midi_tx_used(class))
+				break;
+		}
+
+		// Nichts mehr zu senden: Interrupt abschalten, bis wieder etwas eingefügt wird
+		if(class == N_MIDI_TX_CLASSES)
+		{
+			midi_tx.current = MIDI_TX_NONE;
+			CLEARBIT(UCSRB, UDRIE);
+			return;
+		}
+	}
+
+	midi_tx.current = class;
+
+	uint8_t data = midi_tx_take(class);
+
+	if(data >= 0xF0)
+	{
+		// System-Common und SysEx heben den Running-Status auf
+		midi_tx.running_status = 0;
+		midi_tx.sysex = (data == MIDI_SYSEX_START);
+	}
+	else if(data >= 0x80)
+	{
+		// Running-Status: ein wiederholtes Channel-Status-Byte wird
+		// weggelassen, die Datenbytes liegen immer direkt dahinter
+		if(data == midi_tx.running_status)
+			data = midi_tx_take(class);
+		else
+			midi_tx.running_status = data;
+	}
+
+	UDR = data;
+	midi_tx.sent = 1;
+}
@@ -0,0 +1,190 @@
+/**
+ * @file
+ * Midi-Ausgabe mit Prioritätsklassen, externes Interface
+ *
+ * Jede zu sendende Nachricht landet abhängig von ihrem Status-Byte in einer
+ * von fünf Warteschlangen. Der UDRE-Interrupt wählt an jeder Nachrichtengrenze
+ * die nicht-leere Warteschlange mit der höchsten Priorität, eine laufende
+ * Nachricht wird aber immer zu Ende gesendet. Realtime-Bytes dürfen laut
+ * Midi-Spezifikation zwischen zwei beliebigen Bytes stehen und werden daher
+ * vor jedem Byte bevorzugt.
+ *
+ * NoteOns werden vor NoteOffs gesendet, aber nie vor einem älteren NoteOff
+ * derselben Taste: ein solches NoteOn wird hinter dem NoteOff in dessen
+ * Warteschlange eingereiht. Für jede Taste bleibt so die Reihenfolge erhalten,
+ * in der die Nachrichten eingereiht wurden, auch beim Weiterleiten.
+ *
+ * Eine SysEx-Nachricht belegt die Leitung bis zu ihrem 0xF7, lange Übertragungen
+ * müssen daher in mehrere kurze SysEx-Nachrichten aufgeteilt werden, damit die
+ * Trigger dazwischen gesendet werden können.
+ *
+ * Der Running-Status wird erst beim Senden im Interrupt ausgewertet, weil sich
+ * die Reihenfolge der Nachrichten erst dort ergibt.
+ */
+
+#ifndef MIDI_TX_H_
+#define MIDI_TX_H_
+
+#include <stdint.h>
+
+/**
+ * Größe jeder Sende-Warteschlange in Bytes
+ *
+ * Muss eine Zweierpotenz sein, damit der Ringpuffer-Index mit einer Maske
+ * statt mit einer Division umlaufen kann. Bei 31250 Baud dauert ein Byte 320µs,
+ * 16 Bytes reichen also für 5ms Midi-Ausgabe pro Klasse.
+ */
+#ifndef MIDI_TX_BUFFER_SIZE
+#define MIDI_TX_BUFFER_SIZE 16
+#endif
+
+#if (MIDI_TX_BUFFER_SIZE & (MIDI_TX_BUFFER_SIZE - 1)) || MIDI_TX_BUFFER_SIZE > 128
+#error "MIDI_TX_BUFFER_SIZE muss eine Zweierpotenz <= 128 sein"
+#endif
+
+/**
+ * Prioritätsklasse der Realtime-Bytes (0xF8-0xFF), z.B. der gesendeten Clock
+ */
+#define MIDI_TX_REALTIME 0
+
+/**
+ * Prioritätsklasse der NoteOn-Nachrichten mit einer Velocity > 0
+ *
+ * Wartet noch ein NoteOff derselben Taste, landet das NoteOn stattdessen in
+ * MIDI_TX_NOTEOFF.
+ */
+#define MIDI_TX_NOTEON 1
+
+/**
+ * Prioritätsklasse der NoteOff-Nachrichten, auch als NoteOn mit Velocity 0
+ */
+#define MIDI_TX_NOTEOFF 2
+
+/**
+ * Prioritätsklasse der übrigen Channel-Voice- und System-Common-Nachrichten,
+ * z.B. Control-Changes und NRPNs
+ */
+#define MIDI_TX_CONTROL 3
+
+/**
+ * Prioritätsklasse der SysEx-Nachrichten (0xF0 bis 0xF7)
+ */
+#define MIDI_TX_SYSEX 4
+
+/**
+ * Anzahl der Prioritätsklassen
+ */
+#define N_MIDI_TX_CLASSES 5
+
+/**
+ * Die Sende-Warteschlangen leeren
+ *
+ * Wird von midi_init aufgerufen.
+ */
+void midi_tx_init(void);
+
+/**
+ * Ein Byte zum Senden in die Warteschlange seiner Klasse legen
+ *
+ * Blockiert nicht: das Byte wird vom UDRE-Interrupt versendet, sobald der UART
+ * frei ist. Gibt 1 zurück, wenn das Byte in der Warteschlange liegt, und 0, wenn
+ * sie voll war. In diesem Fall wird das Byte verworfen und der Überlauf-Zähler
+ * erhöht.
+ *
+ * @see midi_send_message
+ */
+uint8_t midi_send(uint8_t data);
+
+/**
+ * Eine komplette Midi-Nachricht in die Warteschlange ihrer Klasse legen
+ *
+ * Die Klasse ergibt sich aus dem ersten Byte. Die Nachricht wird entweder
+ * vollständig oder gar nicht übernommen, so dass bei einer vollen Warteschlange
+ * keine halben Nachrichten auf die Leitung gelangen. Gibt 1 bei Erfolg und 0
+ * bei einem Überlauf zurück.
+ *
+ * Channel-Voice-Nachrichten müssen immer mit ihrem Status-Byte übergeben
+ * werden, der Running-Status wird beim Senden hergestellt. Nachrichten, die mit
+ * einem Datenbyte beginnen, gelten als Fortsetzung einer SysEx-Nachricht.
+ */
+uint8_t midi_send_message(const uint8_t *data, uint8_t length);
+
+/**
+ * Eine empfangene Nachricht weiterleiten
+ *
+ * Wie midi_send_message, zusätzlich wird die Zeit vom Empfang (timestamp, der
+ * Timer1-Zählerstand im Empfangs-Interrupt) bis zum Senden gemessen.
+ *
+ * @see midi_tx_thru_latency_max
+ */
+uint8_t midi_send_thru(const uint8_t *data, uint8_t length, uint16_t timestamp);
+
+/**
+ * Eine Channel-Voice-Nachricht mit zwei Datenbytes senden
+ *
+ * Entspricht status dem zuletzt gesendeten Status-Byte, wird es beim Senden
+ * weggelassen (Running-Status) und nur die beiden Datenbytes gesendet.
+ */
+uint8_t midi_send_voice(uint8_t status, uint8_t data1, uint8_t data2);
+
+/**
+ * Anzahl der freien Bytes in der Warteschlange einer Klasse
+ */
+uint8_t midi_tx_free(uint8_t class);
+
+/**
+ * Anzahl der noch nicht gesendeten Bytes in der Warteschlange einer Klasse
+ */
+uint8_t midi_tx_pending(uint8_t class);
+
+/**
+ * Höchster bisher erreichter Füllstand aller Warteschlangen zusammen in Bytes
+ */
+uint8_t midi_tx_high_water(void);
+
+/**
+ * Anzahl der Nachrichten, die wegen einer vollen Warteschlange verworfen wurden
+ */
+uint16_t midi_tx_overflows(void);
+
+/**
+ * Gibt 1 zurück, wenn seit dem letzten Aufruf ein Byte gesendet wurde
+ */
+uint8_t midi_tx_sent(void);
+
+/**
+ * Größte gemessene Wartezeit einer Nachricht der Klasse in Timer-Ticks
+ *
+ * Gemessen wird vom Einreihen bis zum Senden des ersten Bytes, und zwar an
+ * Stichproben: pro Klasse ist immer nur eine Nachricht gleichzeitig in Messung.
+ *
+ * @see TIMER_TICKS_PER_MS
+ */
+uint16_t midi_tx_latency_max(uint8_t class);
+
+/**
+ * Mittlere Wartezeit einer Nachricht der Klasse in Timer-Ticks
+ *
+ * Gleitender Mittelwert über die Stichproben.
+ *
+ * @see midi_tx_latency_max
+ */
+uint16_t midi_tx_latency_mean(uint8_t class);
+
+/**
+ * Größte gemessene Zeit vom Empfang bis zum Senden einer weitergeleiteten
+ * Nachricht in Timer-Ticks
+ *
+ * @see midi_send_thru
+ */
+uint16_t midi_tx_thru_latency_max(void);
+
+/**
+ * Mittlere Zeit vom Empfang bis zum Senden einer weitergeleiteten Nachricht
+ * in Timer-Ticks
+ *
+ * @see midi_send_thru
+ */
+uint16_t midi_tx_thru_latency_mean(void);
+
+#endif /* MIDI_TX_H_ */
@@ -0,0 +1,810 @@
+/**
+ * @file
+ * Verwaltung der Patterns
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "bits.h"
+#include "eeprom_queue.h"
+#include "io_config.h"
+#include "pattern.h"
+
+/**
+ * Event-Handler zum Vorab-Laden eines vorgemerkten Patterns
+ */
+pattern_handler prefetch_callback;
+
+/**
+ * Event-Handler für das Umschalten auf ein Pattern
+ */
+pattern_handler switch_callback;
+
+/**
+ * Zustand der Pattern-Auswahl
+ */
+struct {
+	// Aktuell spielendes Pattern
+	uint8_t current;
+
+	// Vorgemerktes Pattern oder PATTERN_NONE
+	uint8_t pending;
+
+	// Quantum des Wechsels in Steps
+	uint8_t quantum;
+
+	// 1, wenn die Arbeitskopie Änderungen enthält, die noch nicht spielen
+	uint8_t edited;
+
+	// 1, wenn die Arbeitskopie vor der nächsten Änderung neu kopiert werden muss
+	uint8_t stale;
+
+	// Pattern, das auf den freien Speicherplatz umzieht, oder PATTERN_NONE
+	uint8_t migrate;
+
+	// 1, wenn das vorgemerkte Pattern ohne Rücksicht auf das Quantum am
+	// nächsten Step wirksam wird
+	uint8_t jump;
+
+	// Pattern, das für pattern_read und pattern_write bis zum nächsten Step im
+	// Puffer für das vorgemerkte Pattern bleibt, oder PATTERN_NONE
+	uint8_t access;
+} pattern_state = {
+	.current = 0,
+	.pending = PATTERN_NONE,
+	.migrate = PATTERN_NONE,
+	.access = PATTERN_NONE,
+	.quantum = PATTERN_QUANTUM_DEFAULT,
+	.stale = 1
+};
+
+/**
+ * Ein Pattern ohne Trigger, alle Stufen auf PATTERN_LEVEL_DEFAULT
+ */
+#define PATTERN_EMPTY { \
+	.levels = { [0 ... N_STEPS - 1] = PATTERN_LEVELS_DEFAULT } \
+}
+
+/**
+ * Kennung des Formats der Pattern-Bank im EEPROM
+ *
+ * Muss erhöht werden, wenn sich pattern_t ändert.
+ */
+#define PATTERN_BANK_VERSION 2
+
+/**
+ * Kennung des Formats der Pattern-Bank im EEPROM
+ */
+uint8_t pattern_bank_version EEMEM = PATTERN_BANK_VERSION;
+
+/**
+ * Der bisher fest eingebaute Beat
+ */
+#define PATTERN_DEFAULT { \
+	.steps = { \
+		BIT(0),          /* Bass Drum */ \
+		0, \
+		BIT(5),          /* Closed Hi Hat */ \
+		0, \
+		BIT(1) | BIT(2), /* Snare Drum, Mid-Tom */ \
+		0, \
+		BIT(5),          /* Closed Hi Hat */ \
+		0, \
+		BIT(0),          /* Bass Drum */ \
+		0, \
+		BIT(6),          /* Open Hi Hat */ \
+		0, \
+		BIT(1) | BIT(2), /* Snare Drum, Mid-Tom */ \
+		0, \
+		BIT(5),          /* Closed Hi Hat */ \
+		0 \
+	}, \
+	.levels = { [0 ... N_STEPS - 1] = PATTERN_LEVELS_DEFAULT } \
+}
+
+/**
+ * Der fest eingebaute Beat im Flash, für ein leeres EEPROM
+ */
+static const pattern_t pattern_default PROGMEM = PATTERN_DEFAULT;
+
+/**
+ * Die Speicherplätze der Patterns im EEPROM
+ *
+ * Pattern 1 enthält nach dem ersten Einschalten den bisher fest eingebauten
+ * Beat.
+ */
+pattern_t pattern_slots[PATTERN_N_SLOTS] EEMEM = {
+	[0] = PATTERN_DEFAULT,
+	[1 ... PATTERN_N_SLOTS - 1] = PATTERN_EMPTY
+};
+
+/**
+ * Speicherplatz jedes Patterns im EEPROM
+ */
+uint8_t pattern_map_eeprom[N_PATTERNS] EEMEM = {
+	0, 1, 2, 3, 4, 5, 6, 7
+};
+
+/**
+ * Gesicherte Anzahl der Schreibvorgänge pro Speicherplatz
+ */
+uint16_t pattern_wear_eeprom[PATTERN_N_SLOTS] EEMEM;
+
+/**
+ * Speicherplatz jedes Patterns, Kopie von pattern_map_eeprom
+ */
+uint8_t pattern_map[N_PATTERNS];
+
+/**
+ * Anzahl der Schreibvorgänge pro Speicherplatz
+ */
+uint16_t pattern_wear[PATTERN_N_SLOTS];
+
+/**
+ * Ein Pattern im RAM
+ */
+typedef struct {
+	/// Inhalt des Patterns
+	pattern_t data;
+
+	/// Nummer des Patterns oder PATTERN_NONE
+	uint8_t pattern;
+
+	/// 1, solange Änderungen noch nicht zum Zurückschreiben eingereiht sind
+	uint8_t dirty;
+} pattern_buffer_t;
+
+/**
+ * Die Patterns im RAM
+ *
+ * Die Puffer wechseln ihre Rolle nur durch Tauschen der Zeiger, so dass das
+ * Veröffentlichen von Änderungen und das Umschalten unabhängig von der Größe
+ * eines Patterns immer gleich lange dauern.
+ */
+pattern_buffer_t pattern_buffers[3];
+
+/**
+ * Der Puffer mit dem spielenden Pattern, wird nur gelesen
+ */
+pattern_buffer_t *pattern_playing = &pattern_buffers[0];
+
+/**
+ * Die Arbeitskopie des spielenden Patterns, in die alle Änderungen gehen
+ */
+pattern_buffer_t *pattern_shadow = &pattern_buffers[1];
+
+/**
+ * Der Puffer für das vorgemerkte Pattern, hält nach einem Wechsel noch das
+ * bisherige Pattern, bis es zurückgeschrieben ist
+ */
+pattern_buffer_t *pattern_next = &pattern_buffers[2];
+
+/**
+ * Anschlagstärke pro Stufe, die zweiten vier Einträge gelten für betonte Steps
+ */
+uint8_t pattern_velocity[PATTERN_N_VELOCITIES] = {
+	40, 70, 95, 115,
+	60, 95, 115, 127
+};
+
+/*
+ * Die Patterns initialisieren
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_init(void)
+{
+	// Ein leeres oder veraltetes EEPROM einmalig mit der Voreinstellung beschreiben
+	if(eeprom_read_byte(&pattern_bank_version) != PATTERN_BANK_VERSION)
+	{
+		pattern_t data;
+
+		// Pattern 1 bekommt wie beim Programmieren des EEPROMs den fest
+		// eingebauten Beat, alle anderen bleiben leer
+		memcpy_P(&data, &pattern_default, sizeof(pattern_t));
+
+		for(uint8_t slot = 0; slot < PATTERN_N_SLOTS; slot++)
+		{
+			eeprom_update_block(&data, &pattern_slots[slot], sizeof(pattern_t));
+			eeprom_update_word(&pattern_wear_eeprom[slot], 0);
+
+			if(slot == 0)
+				data = (pattern_t)PATTERN_EMPTY;
+		}
+
+		for(uint8_t pattern = 0; pattern < N_PATTERNS; pattern++)
+			eeprom_update_byte(&pattern_map_eeprom[pattern], pattern);
+
+		eeprom_update_byte(&pattern_bank_version, PATTERN_BANK_VERSION);
+	}
+
+	eeprom_read_block(pattern_map, pattern_map_eeprom, sizeof(pattern_map));
+	eeprom_read_block(pattern_wear, pattern_wear_eeprom, sizeof(pattern_wear));
+
+	pattern_playing->pattern = pattern_state.current;
+	pattern_next->pattern = PATTERN_NONE;
+	eeprom_read_block(&pattern_playing->data, &pattern_slots[pattern_map[pattern_state.current]], sizeof(pattern_t));
+}
+
+/**
+ * Die Arbeitskopie des spielenden Patterns zum Ändern
+ *
+ * Wurde seit der letzten Änderung umgeschaltet oder veröffentlicht, wird sie
+ * erst vom spielenden Pattern kopiert.
+ */
+static pattern_t *pattern_edit(void)
+{
+	if(pattern_state.stale)
+	{
+		memcpy(&pattern_shadow->data, &pattern_playing->data, sizeof(pattern_t));
+		pattern_shadow->pattern = pattern_playing->pattern;
+		pattern_state.stale = 0;
+	}
+
+	return &pattern_shadow->data;
+}
+
+/**
+ * Der Speicherplatz, der keinem Pattern zugeordnet ist
+ */
+static uint8_t pattern_spare_slot(void)
+{
+	uint16_t used = 0;
+
+	for(uint8_t pattern = 0; pattern < N_PATTERNS; pattern++)
+		used |= (uint16_t)1 << pattern_map[pattern];
+
+	uint8_t slot = 0;
+	while(slot < PATTERN_N_SLOTS - 1 && (used & ((uint16_t)1 << slot)))
+		slot++;
+
+	return slot;
+}
+
+/**
+ * Die Änderungen eines Puffers zum Zurückschreiben einreihen
+ *
+ * Ist der Speicherplatz des Patterns um PATTERN_WEAR_SPREAD Schreibvorgänge
+ * stärker abgenutzt als der freie Platz, zieht das Pattern dorthin um. Die
+ * neue Zuordnung wird erst nach dem Pattern selbst geschrieben, so dass nach
+ * einem Stromausfall immer ein vollständiges Pattern zugeordnet ist.
+ */
+static void pattern_writeback(pattern_buffer_t *buffer)
+{
+	if(!buffer->dirty || eeprom_queue_pending(&buffer->data, sizeof(pattern_t)))
+		return;
+
+	// Platz für das Pattern, die Zuordnung und den Zähler
+	if(eeprom_queue_depth() > EEPROM_QUEUE_SIZE - 4)
+		return;
+
+	uint8_t pattern = buffer->pattern;
+	uint8_t slot = pattern_map[pattern];
+	uint8_t spare = pattern_spare_slot();
+
+	if(pattern_wear[slot] > pattern_wear[spare] && pattern_wear[slot] - pattern_wear[spare] >= PATTERN_WEAR_SPREAD)
+		slot = spare;
+
+	if(pattern == pattern_state.migrate)
+	{
+		slot = spare;
+		pattern_state.migrate = PATTERN_NONE;
+	}
+
+	eeprom_queue_write(&pattern_slots[slot], &buffer->data, sizeof(pattern_t));
+
+	if(slot != pattern_map[pattern])
+	{
+		pattern_map[pattern] = slot;
+		eeprom_queue_write(&pattern_map_eeprom[pattern], &pattern_map[pattern], 1);
+	}
+
+	// Den Zähler nur selten sichern, um nicht seinen eigenen Platz abzunutzen
+	if(pattern_wear[slot] < UINT16_MAX && ++pattern_wear[slot] % PATTERN_WEAR_INTERVAL == 0)
+		eeprom_queue_write(&pattern_wear_eeprom[slot], &pattern_wear[slot], sizeof(uint16_t));
+
+	buffer->dirty = 0;
+}
+
+/**
+ * Ein selten geändertes Pattern auf den freien Speicherplatz umziehen lassen
+ *
+ * Ist der freie Platz um PATTERN_WEAR_SPREAD Schreibvorgänge stärker
+ * abgenutzt als der am wenigsten abgenutzte belegte Platz, wird dessen Pattern
+ * über den Puffer für das vorgemerkte Pattern auf den freien Platz kopiert. So
+ * werden auch die Plätze ruhender Patterns für häufig geänderte frei.
+ */
+static void pattern_migrate(void)
+{
+	// Das geladene Pattern zum Zurückschreiben freigeben
+	if(pattern_state.migrate != PATTERN_NONE)
+	{
+		if(pattern_next->pattern == pattern_state.migrate && !eeprom_queue_reading())
+			pattern_next->dirty = 1;
+
+		return;
+	}
+
+	if(pattern_state.pending != PATTERN_NONE || pattern_next->dirty || eeprom_queue_reading())
+		return;
+
+	if(pattern_state.access != PATTERN_NONE && pattern_next->pattern == pattern_state.access)
+		return;
+
+	if(eeprom_queue_pending(&pattern_next->data, sizeof(pattern_t)))
+		return;
+
+	uint8_t coldest = PATTERN_NONE;
+	for(uint8_t pattern = 0; pattern < N_PATTERNS; pattern++)
+	{
+		if(pattern == pattern_state.current)
+			continue;
+
+		if(coldest == PATTERN_NONE || pattern_wear[pattern_map[pattern]] < pattern_wear[pattern_map[coldest]])
+			coldest = pattern;
+	}
+
+	uint16_t spare = pattern_wear[pattern_spare_slot()];
+	uint16_t cold = pattern_wear[pattern_map[coldest]];
+	if(spare < cold || spare - cold < PATTERN_WEAR_SPREAD)
+		return;
+
+	// Hält der Puffer das Pattern schon, muss es nicht geladen werden
+	if(pattern_next->pattern != coldest)
+	{
+		if(!eeprom_queue_read(&pattern_next->data, &pattern_slots[pattern_map[coldest]], sizeof(pattern_t)))
+			return;
+
+		pattern_next->pattern = coldest;
+	}
+
+	pattern_state.migrate = coldest;
+}
+
+/**
+ * Das Laden des vorgemerkten Patterns anstoßen
+ *
+ * Der Puffer wird erst überschrieben, wenn sein bisheriges Pattern
+ * zurückgeschrieben ist. Hält er das vorgemerkte Pattern noch, muss nichts
+ * geladen werden.
+ */
+static void pattern_prefetch(void)
+{
+	uint8_t pattern = pattern_state.pending;
+
+	if(pattern == PATTERN_NONE || pattern_next->pattern == pattern)
+		return;
+
+	// Der Puffer wird gerade von pattern_read oder pattern_write benutzt
+	if(pattern_state.access != PATTERN_NONE && pattern_next->pattern == pattern_state.access)
+		return;
+
+	if(pattern_next->dirty || eeprom_queue_pending(&pattern_next->data, sizeof(pattern_t)))
+		return;
+
+	if(eeprom_queue_read(&pattern_next->data, &pattern_slots[pattern_map[pattern]], sizeof(pattern_t)))
+		pattern_next->pattern = pattern;
+}
+
+/*
+ * Änderungen zurückschreiben und das vorgemerkte Pattern laden
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_poll(void)
+{
+	// Die Arbeitskopie schon vor der nächsten Änderung auffrischen
+	pattern_edit();
+
+	pattern_migrate();
+	pattern_writeback(pattern_playing);
+	pattern_writeback(pattern_next);
+	pattern_prefetch();
+}
+
+/*
+ * Einen Pattern-Wechsel vormerken
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_select(uint8_t pattern)
+{
+	if(pattern >= N_PATTERNS)
+		return;
+
+	pattern_state.jump = 0;
+
+	// Das laufende Pattern wieder gewählt: einen vorgemerkten Wechsel verwerfen
+	if(pattern == pattern_state.current)
+	{
+		pattern_state.pending = PATTERN_NONE;
+		return;
+	}
+
+	pattern_state.pending = pattern;
+
+	// Schon während des laufenden Taktes laden
+	pattern_state.access = PATTERN_NONE;
+	pattern_prefetch();
+
+	if(prefetch_callback) prefetch_callback(pattern);
+}
+
+/**
+ * Änderungen veröffentlichen, die Arbeitskopie wird zum spielenden Pattern
+ *
+ * Wird das spielende Pattern noch zurückgeschrieben, darf es nicht zur
+ * Arbeitskopie werden, die Änderungen folgen dann beim nächsten Aufruf.
+ */
+static void pattern_publish(void)
+{
+	if(pattern_state.edited && !eeprom_queue_pending(&pattern_playing->data, sizeof(pattern_t)))
+	{
+		pattern_buffer_t *playing = pattern_shadow;
+		pattern_shadow = pattern_playing;
+		pattern_playing = playing;
+
+		// Die Pflicht zum Zurückschreiben geht mit
+		playing->dirty = 1;
+		pattern_shadow->dirty = 0;
+
+		pattern_state.edited = 0;
+		pattern_state.stale = 1;
+	}
+}
+
+/**
+ * Auf das vorgemerkte Pattern umschalten
+ *
+ * Ist das Pattern noch nicht geladen oder sind noch Änderungen offen, bleibt
+ * es vorgemerkt.
+ */
+static void pattern_switch(void)
+{
+	if(pattern_next->pattern != pattern_state.pending || eeprom_queue_reading() || pattern_state.edited)
+		return;
+
+	// Das bisherige Pattern bleibt zum Zurückschreiben im anderen Puffer
+	pattern_buffer_t *playing = pattern_next;
+	pattern_next = pattern_playing;
+	pattern_playing = playing;
+	pattern_state.stale = 1;
+
+	pattern_state.current = pattern_state.pending;
+	pattern_state.pending = PATTERN_NONE;
+	pattern_state.jump = 0;
+
+	if(switch_callback) switch_callback(pattern_state.current);
+}
+
+/*
+ * Einen Step melden
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_step(uint8_t step)
+{
+	pattern_publish();
+
+	// Ein vorgemerkter Wechsel darf den Puffer ab jetzt wieder belegen
+	pattern_state.access = PATTERN_NONE;
+
+	if(pattern_state.pending == PATTERN_NONE || (!pattern_state.jump && step % pattern_state.quantum))
+		return;
+
+	pattern_switch();
+}
+
+/*
+ * Sofort auf ein Pattern umschalten
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_jump(uint8_t pattern)
+{
+	pattern_select(pattern);
+
+	// Nicht auf das Quantum warten, nur auf das Laden
+	if(pattern_state.pending != PATTERN_NONE)
+		pattern_state.jump = 1;
+}
+
+/*
+ * Das aktuell spielende Pattern
+ */
+uint8_t pattern_current(void)
+{
+	return pattern_state.current;
+}
+
+/*
+ * Das vorgemerkte Pattern
+ */
+uint8_t pattern_pending(void)
+{
+	return pattern_state.pending;
+}
+
+/*
+ * Die Anschlagstärke eines Instruments auf einem Step im aktuellen Pattern
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t pattern_trigger(uint8_t instrument, uint8_t step)
+{
+	// Der Zeiger wird nur an den Step-Grenzen getauscht
+	const pattern_t *active = &pattern_playing->data;
+
+	if(!BITSET(active->steps[step], instrument))
+		return 0;
+
+	// Betonte Steps verwenden die zweite Hälfte der Tabelle
+	uint8_t index = (active->levels[step] >> (instrument * 2)) & 0x03;
+	if((active->accents >> step) & 1)
+		index += PATTERN_N_LEVELS;
+
+	return pattern_velocity[index];
+}
+
+/*
+ * Ein Instrument auf einem Step aufnehmen
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_record(uint8_t instrument, uint8_t step, uint8_t velocity)
+{
+	if(instrument >= N_INSTRUMENTS || step >= N_STEPS)
+		return;
+
+	// Die Stufe wählen, deren Anschlagstärke am nächsten liegt
+	uint8_t level = 0;
+	while(level < PATTERN_N_LEVELS - 1 && velocity > (pattern_velocity[level] + pattern_velocity[level + 1]) / 2)
+		level++;
+
+	SETBIT(pattern_edit()->steps[step], instrument);
+	pattern_set_level(instrument, step, level);
+}
+
+/*
+ * Die Spur eines Instruments lesen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint16_t pattern_get_lane(uint8_t instrument)
+{
+	uint16_t lane = 0;
+
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	const pattern_t *shadow = pattern_edit();
+
+	for(uint8_t step = 0; step < N_STEPS; step++)
+	{
+		if(BITSET(shadow->steps[step], instrument))
+			lane |= (uint16_t)1 << step;
+	}
+
+	return lane;
+}
+
+/*
+ * Die Spur eines Instruments setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_set_lane(uint8_t instrument, uint16_t lane)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return;
+
+	pattern_t *shadow = pattern_edit();
+
+	for(uint8_t step = 0; step < N_STEPS; step++, lane >>= 1)
+	{
+		if(lane & 1)
+			SETBIT(shadow->steps[step], instrument);
+		else
+			CLEARBIT(shadow->steps[step], instrument);
+	}
+
+	pattern_state.edited = 1;
+}
+
+/*
+ * Die Stufe eines Instruments auf einem Step
+ */
+uint8_t pattern_get_level(uint8_t instrument, uint8_t step)
+{
+	if(instrument >= N_INSTRUMENTS || step >= N_STEPS)
+		return 0;
+
+	return (pattern_edit()->levels[step] >> (instrument * 2)) & 0x03;
+}
+
+/*
+ * Die Stufe eines Instruments auf einem Step setzen
+ */
+void pattern_set_level(uint8_t instrument, uint8_t step, uint8_t level)
+{
+	if(instrument >= N_INSTRUMENTS || step >= N_STEPS)
+		return;
+
+	pattern_t *shadow = pattern_edit();
+
+	uint16_t levels = shadow->levels[step];
+	levels &= ~((uint16_t)0x03 << (instrument * 2));
+	levels |= (uint16_t)(level & 0x03) << (instrument * 2);
+	shadow->levels[step] = levels;
+
+	pattern_state.edited = 1;
+}
+
+/*
+ * Die Spur der betonten Steps
+ */
+uint16_t pattern_get_accents(void)
+{
+	return pattern_edit()->accents;
+}
+
+/*
+ * Die Spur der betonten Steps setzen
+ */
+void pattern_set_accents(uint16_t accents)
+{
+	pattern_edit()->accents = accents;
+	pattern_state.edited = 1;
+}
+
+/*
+ * Das spielende Pattern löschen
+ */
+void pattern_clear(void)
+{
+	pattern_t empty = PATTERN_EMPTY;
+
+	memcpy(pattern_edit(), &empty, sizeof(pattern_t));
+	pattern_state.edited = 1;
+}
+
+/*
+ * Die Anschlagstärke einer Stufe setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void pattern_set_velocity(uint8_t index, uint8_t velocity)
+{
+	if(index >= PATTERN_N_VELOCITIES || velocity < 1 || velocity > 127)
+		return;
+
+	pattern_velocity[index] = velocity;
+}
+
+/*
+ * Die Anschlagstärke einer Stufe
+ */
+uint8_t pattern_get_velocity(uint8_t index)
+{
+	if(index >= PATTERN_N_VELOCITIES)
+		return 0;
+
+	return pattern_velocity[index];
+}
+
+/**
+ * Ein Pattern für pattern_read und pattern_write bereitstellen
+ *
+ * Gibt den Puffer zurück, wenn das Pattern im RAM liegt. Andernfalls wird es im
+ * Hintergrund in den Puffer für das vorgemerkte Pattern geladen, sobald dieser
+ * zurückgeschrieben ist, und NULL zurückgegeben. Bis zum nächsten Step bleibt
+ * der Puffer dem Pattern vorbehalten.
+ */
+static pattern_t *pattern_access(uint8_t pattern)
+{
+	if(pattern == pattern_state.current)
+		return pattern_edit();
+
+	pattern_state.access = pattern;
+
+	if(pattern_next->pattern == pattern)
+		return eeprom_queue_reading() ? NULL : &pattern_next->data;
+
+	// Ein Umzug muss erst abgeschlossen werden
+	if(pattern_state.migrate != PATTERN_NONE)
+		return NULL;
+
+	if(pattern_next->dirty || eeprom_queue_pending(&pattern_next->data, sizeof(pattern_t)))
+		return NULL;
+
+	if(eeprom_queue_read(&pattern_next->data, &pattern_slots[pattern_map[pattern]], sizeof(pattern_t)))
+		pattern_next->pattern = pattern;
+
+	return NULL;
+}
+
+/*
+ * Ein Byte eines Patterns lesen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t pattern_read(uint8_t pattern, uint8_t offset, uint8_t *data)
+{
+	if(pattern >= N_PATTERNS || offset >= sizeof(pattern_t))
+	{
+		*data = 0;
+		return 1;
+	}
+
+	const pattern_t *buffer = pattern_access(pattern);
+	if(!buffer)
+		return 0;
+
+	*data = ((const uint8_t*)buffer)[offset];
+	return 1;
+}
+
+/*
+ * Ein Byte eines Patterns schreiben
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t pattern_write(uint8_t pattern, uint8_t offset, uint8_t data)
+{
+	if(pattern >= N_PATTERNS || offset >= sizeof(pattern_t))
+		return 1;
+
+	pattern_t *buffer = pattern_access(pattern);
+	if(!buffer)
+		return 0;
+
+	((uint8_t*)buffer)[offset] = data;
+
+	// Das spielende Pattern wird in der Arbeitskopie geändert und am nächsten
+	// Step veröffentlicht, jedes andere von pattern_poll zurückgeschrieben
+	if(pattern == pattern_state.current)
+		pattern_state.edited = 1;
+	else
+		pattern_next->dirty = 1;
+
+	return 1;
+}
+
+/*
+ * Das Quantum des Pattern-Wechsels setzen
+ */
+void pattern_set_quantum(uint8_t steps)
+{
+	if(steps < 1)
+		steps = 1;
+	else if(steps > N_STEPS)
+		steps = N_STEPS;
+
+	pattern_state.quantum = steps;
+}
+
+/*
+ * Das Quantum des Pattern-Wechsels
+ */
+uint8_t pattern_get_quantum(void)
+{
+	return pattern_state.quantum;
+}
+
+/*
+ * Anzahl der Schreibvorgänge eines Speicherplatzes
+ */
+uint16_t pattern_slot_writes(uint8_t slot)
+{
+	if(slot >= PATTERN_N_SLOTS)
+		return 0;
+
+	return pattern_wear[slot];
+}
+
+/*
+ * Den Event-Handler zum Vorab-Laden setzen
+ */
+void pattern_set_prefetch_handler(pattern_handler callback)
+{
+	prefetch_callback = callback;
+}
+
+/*
+ * Den Event-Handler für das Umschalten setzen
+ */
+void pattern_set_switch_handler(pattern_handler callback)
+{
+	switch_callback = callback;
+}
@@ -0,0 +1,304 @@
+/**
+ * @file
+ * Verwaltung der Patterns, externes Interface
+ *
+ * Ein Pattern-Wechsel (z.B. per Song Select oder Program Change) wird nicht
+ * sofort ausgeführt, sondern vorgemerkt und erst an der nächsten Taktgrenze
+ * bzw. dem nächsten Vielfachen des eingestellten Quantums wirksam. Beim
+ * Vormerken wird das neue Pattern über den Prefetch-Handler schon während des
+ * laufenden Taktes geladen, an der Grenze selbst bleibt nur noch das
+ * Umschalten.
+ *
+ * Der Wechsel wird von pattern_step an den Steps ausgelöst und funktioniert
+ * damit unabhängig davon, ob die Clock intern oder extern erzeugt wird.
+ *
+ * Ein Pattern speichert pro Step ein Byte mit einem Bit pro Instrument. Jedes
+ * Instrument spielt seine Spur mit eigener Länge und eigenem Tempo (siehe
+ * track.h) und fragt seine Trigger daher einzeln mit pattern_trigger ab. Zum
+ * Bearbeiten lässt sich die Spur eines Instruments als 16-Bit-Wert mit einem
+ * Bit pro Step lesen und schreiben.
+ *
+ * Die Anschlagstärke wird pro Step und Instrument als eine von vier Stufen
+ * (2 Bit) gespeichert, dazu kommt eine Spur betonter Steps. Beim Auslösen wird
+ * die Stufe über eine Tabelle in eine Anschlagstärke übersetzt, betonte Steps
+ * verwenden eine zweite Tabelle. Ein Pattern belegt so 50 Bytes, alle
+ * N_PATTERNS Patterns passen in das EEPROM.
+ *
+ * Die Patterns liegen im EEPROM, im RAM stehen nur das spielende und das
+ * vorgemerkte Pattern sowie eine Arbeitskopie des spielenden Patterns. Alle
+ * Änderungen gehen in die Arbeitskopie und werden von pattern_step am nächsten
+ * Step veröffentlicht, indem die Zeiger auf die beiden Puffer getauscht
+ * werden. Das Auslösen eines Steps sieht so nie ein halb geändertes Pattern,
+ * z.B. eine halb gesetzte Spur, und das Veröffentlichen kostet unabhängig von
+ * der Größe eines Patterns immer gleich viel. Das Nachziehen der Arbeitskopie
+ * übernimmt pattern_poll bzw. die nächste Änderung.
+ *
+ * Änderungen reiht pattern_poll zum Schreiben im Hintergrund ein (siehe
+ * eeprom_queue.h), geladen wird ebenfalls im Hintergrund.
+ *
+ * Für N_PATTERNS Patterns gibt es PATTERN_N_SLOTS Speicherplätze, einer ist
+ * immer frei. Pro Platz wird gezählt, wie oft er beschrieben wurde; ist der
+ * Platz eines Patterns um PATTERN_WEAR_SPREAD Schreibvorgänge stärker
+ * abgenutzt als der freie, zieht das Pattern beim nächsten Zurückschreiben
+ * dorthin um. Umgekehrt zieht ein ruhendes Pattern auf den freien Platz um,
+ * wenn dieser um PATTERN_WEAR_SPREAD Schreibvorgänge stärker abgenutzt ist als
+ * der Platz des Patterns. So verteilt sich die Abnutzung auch dann auf alle
+ * Plätze, wenn immer dasselbe Pattern bearbeitet wird.
+ *
+ * Live eingespielte Noten werden von midi.c auf den nächstgelegenen Step
+ * quantisiert und mit pattern_record in das laufende Pattern eingetragen.
+ */
+
+#ifndef PATTERN_H_
+#define PATTERN_H_
+
+#include <stdint.h>
+
+#include "io_config.h"
+
+/**
+ * Anzahl der Patterns
+ */
+#define N_PATTERNS 8
+
+/**
+ * Anzahl der Speicherplätze für Patterns im EEPROM
+ */
+#define PATTERN_N_SLOTS (N_PATTERNS + 1)
+
+/**
+ * Vorsprung an Schreibvorgängen, ab dem ein Pattern auf den freien Platz umzieht
+ */
+#define PATTERN_WEAR_SPREAD 64
+
+/**
+ * Die Zähler der Schreibvorgänge werden nur bei jedem
+ * PATTERN_WEAR_INTERVAL-ten Schreibvorgang gesichert
+ */
+#define PATTERN_WEAR_INTERVAL 8
+
+/**
+ * Kein Pattern vorgemerkt
+ */
+#define PATTERN_NONE 0xFF
+
+/**
+ * Quantum des Pattern-Wechsels nach dem Einschalten: ein ganzer Takt
+ */
+#define PATTERN_QUANTUM_DEFAULT N_STEPS
+
+/**
+ * Anzahl der Stufen der Anschlagstärke
+ */
+#define PATTERN_N_LEVELS 4
+
+/**
+ * Anzahl der Einträge der Anschlagstärke-Tabelle: jede Stufe unbetont und betont
+ */
+#define PATTERN_N_VELOCITIES (PATTERN_N_LEVELS * 2)
+
+/**
+ * Stufe der Anschlagstärke in einem neuen Pattern
+ */
+#define PATTERN_LEVEL_DEFAULT 1
+
+/**
+ * Stufen eines Steps, bei denen alle Instrumente auf PATTERN_LEVEL_DEFAULT stehen
+ */
+#define PATTERN_LEVELS_DEFAULT (PATTERN_LEVEL_DEFAULT * 0x5555)
+
+/**
+ * Daten eines Patterns
+ */
+typedef struct {
+	/// Trigger pro Step, ein Bit pro Instrument
+	uint8_t steps[N_STEPS];
+
+	/// Stufe der Anschlagstärke pro Step, 2 Bit pro Instrument (Instrument 0 in den untersten Bits)
+	uint16_t levels[N_STEPS];
+
+	/// Betonte Steps, Bit n entspricht Step n
+	uint16_t accents;
+} pattern_t;
+
+/**
+ * Definition eines Event-Handler für das Laden oder Umschalten eines Patterns
+ */
+typedef void (*pattern_handler)(uint8_t pattern);
+
+/**
+ * Die Patterns initialisieren und das erste Pattern laden
+ *
+ * Enthält das EEPROM noch keine Patterns, wird es einmalig mit leeren Patterns
+ * beschrieben, was einige Sekunden dauert.
+ */
+void pattern_init(void);
+
+/**
+ * Geänderte Patterns zum Zurückschreiben einreihen und das vorgemerkte Pattern
+ * laden
+ *
+ * Wird aus der Hauptschleife aufgerufen und wartet nie auf das EEPROM. Ein
+ * Pattern wird erst wieder eingereiht, wenn sein letzter Schreibauftrag
+ * abgearbeitet ist.
+ */
+void pattern_poll(void);
+
+/**
+ * Einen Pattern-Wechsel vormerken
+ *
+ * Stößt das Laden des neuen Patterns aus dem EEPROM an und ruft danach den
+ * Prefetch-Handler auf. Nummern ab N_PATTERNS werden ignoriert. Ein bereits
+ * vorgemerkter Wechsel wird ersetzt.
+ */
+void pattern_select(uint8_t pattern);
+
+/**
+ * Einen Step melden
+ *
+ * Wird aus dem Clock-Event-Handler vor dem Auslösen der Trigger des Steps
+ * aufgerufen. Änderungen aus der Arbeitskopie werden hier veröffentlicht,
+ * solange das spielende Pattern noch zurückgeschrieben wird, erst einen Step
+ * später.
+ *
+ * Ist ein Wechsel vorgemerkt und liegt step auf einem Vielfachen des Quantums,
+ * wird umgeschaltet und der Switch-Handler aufgerufen. Ist das Pattern noch
+ * nicht fertig geladen oder sind Änderungen noch nicht veröffentlicht, wird
+ * der Wechsel auf die nächste Grenze verschoben. Das bisherige Pattern bleibt
+ * im RAM, bis seine Änderungen zurückgeschrieben sind.
+ */
+void pattern_step(uint8_t step);
+
+/**
+ * Am nächsten Step auf ein Pattern umschalten
+ *
+ * Wie pattern_select, das Pattern wird aber ohne Rücksicht auf das Quantum am
+ * ersten Step wirksam, an dem es geladen ist. Bis dahin spielt das bisherige
+ * Pattern weiter, gewartet wird nie. Für Sprünge bei Start und Song Position
+ * Pointer im Song-Modus. Nummern ab N_PATTERNS werden ignoriert.
+ */
+void pattern_jump(uint8_t pattern);
+
+/**
+ * Das aktuell spielende Pattern
+ */
+uint8_t pattern_current(void);
+
+/**
+ * Das vorgemerkte Pattern oder PATTERN_NONE
+ */
+uint8_t pattern_pending(void);
+
+/**
+ * Die Anschlagstärke eines Instruments auf einem Step (0 bis N_STEPS-1) im
+ * aktuell spielenden Pattern, 0 wenn es dort nicht getriggert wird
+ *
+ * Wird von track_tick aufgerufen und prüft instrument und step nicht.
+ */
+uint8_t pattern_trigger(uint8_t instrument, uint8_t step);
+
+/**
+ * Ein Instrument auf einem Step des laufenden Patterns aufnehmen
+ *
+ * Die Anschlagstärke wird auf die nächstliegende unbetonte Stufe gerundet.
+ * Wird im Hauptprogramm aufgerufen, der Eintrag wird beim nächsten Durchlauf
+ * des Steps gespielt. Ungültige Instrumente oder Steps werden ignoriert.
+ */
+void pattern_record(uint8_t instrument, uint8_t step, uint8_t velocity);
+
+/**
+ * Die Spur eines Instruments im laufenden Pattern, Bit n entspricht Step n
+ */
+uint16_t pattern_get_lane(uint8_t instrument);
+
+/**
+ * Die Spur eines Instruments im laufenden Pattern setzen, Bit n entspricht Step n
+ */
+void pattern_set_lane(uint8_t instrument, uint16_t lane);
+
+/**
+ * Die Stufe der Anschlagstärke (0-3) eines Instruments auf einem Step
+ */
+uint8_t pattern_get_level(uint8_t instrument, uint8_t step);
+
+/**
+ * Die Stufe der Anschlagstärke (0-3) eines Instruments auf einem Step setzen
+ */
+void pattern_set_level(uint8_t instrument, uint8_t step, uint8_t level);
+
+/**
+ * Die betonten Steps des laufenden Patterns, Bit n entspricht Step n
+ */
+uint16_t pattern_get_accents(void);
+
+/**
+ * Die betonten Steps des laufenden Patterns setzen
+ */
+void pattern_set_accents(uint16_t accents);
+
+/**
+ * Alle Trigger des laufenden Patterns löschen und die Stufen zurücksetzen
+ */
+void pattern_clear(void);
+
+/**
+ * Die Anschlagstärke (1-127) eines Eintrags der Tabelle setzen
+ *
+ * index ist die Stufe, für betonte Steps zuzüglich PATTERN_N_LEVELS.
+ */
+void pattern_set_velocity(uint8_t index, uint8_t velocity);
+
+/**
+ * Die Anschlagstärke eines Eintrags der Tabelle
+ */
+uint8_t pattern_get_velocity(uint8_t index);
+
+/**
+ * Ein Byte eines Patterns in der Darstellung von pattern_t nach data lesen
+ *
+ * Liegt das Pattern nicht im RAM, wird es im Hintergrund geladen und 0
+ * zurückgegeben, der Aufruf muss dann später wiederholt werden. Es wird nie
+ * auf das EEPROM gewartet.
+ */
+uint8_t pattern_read(uint8_t pattern, uint8_t offset, uint8_t *data);
+
+/**
+ * Ein Byte eines Patterns in der Darstellung von pattern_t schreiben
+ *
+ * Geändert wird immer im RAM, pattern_poll sichert die Änderung im
+ * Hintergrund. Liegt das Pattern nicht im RAM, wird es wie bei pattern_read
+ * erst geladen und 0 zurückgegeben, der Aufruf muss dann später wiederholt
+ * werden.
+ */
+uint8_t pattern_write(uint8_t pattern, uint8_t offset, uint8_t data);
+
+/**
+ * Das Quantum des Pattern-Wechsels in Steps setzen (1 bis N_STEPS)
+ */
+void pattern_set_quantum(uint8_t steps);
+
+/**
+ * Das Quantum des Pattern-Wechsels in Steps
+ */
+uint8_t pattern_get_quantum(void);
+
+/**
+ * Wie oft ein Speicherplatz (0 bis PATTERN_N_SLOTS-1) seit dem Formatieren
+ * beschrieben wurde
+ *
+ * Gezählt wird jedes Zurückschreiben eines Patterns, nach einem Neustart
+ * können bis zu PATTERN_WEAR_INTERVAL-1 Vorgänge fehlen.
+ */
+uint16_t pattern_slot_writes(uint8_t slot);
+
+/**
+ * Den Event-Handler zum Vorab-Laden eines vorgemerkten Patterns setzen
+ */
+void pattern_set_prefetch_handler(pattern_handler);
+
+/**
+ * Den Event-Handler für das Umschalten auf ein Pattern setzen
+ */
+void pattern_set_switch_handler(pattern_handler);
+
+#endif /* PATTERN_H_ */
@@ -0,0 +1,252 @@
+/**
+ * @file
+ * Song-Modus: eine Kette von Patterns
+ */
+
+#include <stdint.h>
+#include <avr/eeprom.h>
+
+#include "eeprom_queue.h"
+#include "io_config.h"
+#include "pattern.h"
+#include "song.h"
+
+/**
+ * Der Song im EEPROM, nach dem ersten Einschalten leer
+ */
+song_entry_t song_chain_eeprom[SONG_N_ENTRIES] EEMEM = {
+	[0 ... SONG_N_ENTRIES - 1] = { .pattern = SONG_END, .repeats = 1 }
+};
+
+/**
+ * Der Song, Kopie von song_chain_eeprom
+ */
+song_entry_t song_chain[SONG_N_ENTRIES];
+
+/**
+ * Position im Song
+ */
+struct {
+	// Gerade gespielter Eintrag
+	uint8_t entry;
+
+	// Gerade gespielte Wiederholung des Eintrags
+	uint8_t repeat;
+
+	// 1, wenn der nächste Step 0 den aktuellen Takt beginnt, statt weiterzuschalten
+	uint8_t hold;
+
+	// Step, ab dem das Pattern des nächsten Taktes vorgemerkt wird
+	uint8_t select;
+
+	// 1, wenn das Pattern des nächsten Taktes schon vorgemerkt ist
+	uint8_t prefetched;
+} song_state;
+
+/**
+ * 1, solange der Song wegen einer vollen EEPROM-Warteschlange noch gesichert
+ * werden muss
+ */
+uint8_t song_unsaved;
+
+/**
+ * Eine Position um einen Takt weiterschalten
+ */
+static void song_advance(uint8_t *entry, uint8_t *repeat)
+{
+	if(++*repeat < song_chain[*entry].repeats)
+		return;
+
+	*repeat = 0;
+
+	if(++*entry == SONG_N_ENTRIES || song_chain[*entry].pattern == SONG_END)
+		*entry = 0;
+}
+
+/**
+ * Das Pattern des nächsten Taktes vormerken
+ */
+static void song_prefetch(void)
+{
+	uint8_t entry = song_state.entry;
+	uint8_t repeat = song_state.repeat;
+
+	song_advance(&entry, &repeat);
+	pattern_select(song_chain[entry].pattern);
+}
+
+/**
+ * Den Step bestimmen, an dem das Pattern des nächsten Taktes vorgemerkt wird
+ *
+ * Das ist die letzte Grenze des Quantums vor dem Taktende, der Wechsel wird
+ * so erst an der Taktgrenze wirksam.
+ */
+static void song_update_select(void)
+{
+	uint8_t quantum = pattern_get_quantum();
+	song_state.select = (N_STEPS - 1) / quantum * quantum;
+}
+
+/*
+ * Den Song laden
+ * siehe Header-Datie für mehr Informationen
+ */
+void song_init(void)
+{
+	eeprom_read_block(song_chain, song_chain_eeprom, sizeof(song_chain));
+
+	// Mit den Prüfungen von song_set_entry übernehmen
+	for(uint8_t i = 0; i < SONG_N_ENTRIES; i++)
+		song_set_entry(i, song_chain[i].pattern, song_chain[i].repeats);
+
+	// Das erste Pattern wird im Hintergrund geladen und mit dem ersten Step
+	// wirksam, an dem es bereitliegt
+	song_state.hold = 1;
+	if(song_active())
+		pattern_jump(song_chain[0].pattern);
+}
+
+/*
+ * Gibt 1 zurück, wenn ein Song gespielt wird
+ */
+uint8_t song_active(void)
+{
+	return song_chain[0].pattern != SONG_END;
+}
+
+/*
+ * Einen Step melden
+ * siehe Header-Datie für mehr Informationen
+ */
+void song_step(uint8_t step)
+{
+	if(!song_active())
+		return;
+
+	if(step == 0)
+	{
+		if(song_state.hold)
+			song_state.hold = 0;
+		else
+			song_advance(&song_state.entry, &song_state.repeat);
+
+		song_update_select();
+		song_state.prefetched = 0;
+	}
+
+	// Nach einem Sprung erst vormerken, wenn dessen Pattern spielt, sonst
+	// würde der Sprung überschrieben
+	if(step >= song_state.select && !song_state.prefetched && pattern_pending() == PATTERN_NONE)
+	{
+		song_prefetch();
+		song_state.prefetched = 1;
+	}
+}
+
+/*
+ * Auf einen Takt springen
+ * siehe Header-Datie für mehr Informationen
+ */
+void song_locate(uint16_t bar, uint8_t step)
+{
+	if(!song_active())
+		return;
+
+	// Die Länge des Songs in Takten
+	uint16_t length = 0;
+	for(uint8_t entry = 0; entry < SONG_N_ENTRIES && song_chain[entry].pattern != SONG_END; entry++)
+		length += song_chain[entry].repeats;
+
+	bar %= length;
+
+	uint8_t entry = 0;
+	while(bar >= song_chain[entry].repeats)
+		bar -= song_chain[entry++].repeats;
+
+	song_state.entry = entry;
+	song_state.repeat = bar;
+	song_state.hold = (step == 0);
+
+	// Das Pattern des Taktes wird im Hintergrund geladen und spielt ab dem
+	// ersten Step, an dem es bereitliegt
+	pattern_jump(song_chain[entry].pattern);
+
+	// Liegt die Grenze zum Vormerken im Takt schon zurück, merkt song_step das
+	// Pattern des nächsten Taktes vor, sobald der Sprung ausgeführt ist
+	song_update_select();
+	song_state.prefetched = 0;
+}
+
+/*
+ * Der gerade gespielte Eintrag
+ */
+uint8_t song_position(void)
+{
+	return song_state.entry;
+}
+
+/*
+ * Einen Eintrag setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void song_set_entry(uint8_t index, uint8_t pattern, uint8_t repeats)
+{
+	if(index >= SONG_N_ENTRIES)
+		return;
+
+	if(pattern >= N_PATTERNS)
+		pattern = SONG_END;
+
+	if(repeats < 1)
+		repeats = 1;
+
+	song_chain[index].pattern = pattern;
+	song_chain[index].repeats = repeats;
+
+	// Der gespielte Eintrag gehört nicht mehr zum Song
+	if(song_state.entry >= index && pattern == SONG_END)
+	{
+		song_state.entry = 0;
+		song_state.repeat = 0;
+	}
+}
+
+/*
+ * Pattern eines Eintrags
+ */
+uint8_t song_get_pattern(uint8_t index)
+{
+	if(index >= SONG_N_ENTRIES)
+		return SONG_END;
+
+	return song_chain[index].pattern;
+}
+
+/*
+ * Wiederholungen eines Eintrags
+ */
+uint8_t song_get_repeats(uint8_t index)
+{
+	if(index >= SONG_N_ENTRIES)
+		return 0;
+
+	return song_chain[index].repeats;
+}
+
+/*
+ * Den Song sichern
+ * siehe Header-Datie für mehr Informationen
+ */
+void song_save(void)
+{
+	song_unsaved = !eeprom_queue_write(song_chain_eeprom, song_chain, sizeof(song_chain));
+}
+
+/*
+ * Eine zurückgestellte Sicherung wiederholen
+ */
+void song_poll(void)
+{
+	if(song_unsaved)
+		song_save();
+}
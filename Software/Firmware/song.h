@@ -0,0 +1,120 @@
+/**
+ * @file
+ * Song-Modus: eine Kette von Patterns, externes Interface
+ *
+ * Ein Song ist eine Folge von bis zu SONG_N_ENTRIES Einträgen aus einem
+ * Pattern und der Anzahl seiner Wiederholungen. Er endet am ersten Eintrag
+ * ohne Pattern (SONG_END) und beginnt danach von vorn. Enthält schon der erste
+ * Eintrag kein Pattern, ist der Song-Modus aus und die Patterns werden nur
+ * per Song Select oder Program Change gewechselt.
+ *
+ * Der Song schreitet an den Taktgrenzen fort. Das Pattern des folgenden
+ * Taktes wird an der letzten Grenze des Quantums davor mit pattern_select
+ * vorgemerkt und damit während des laufenden Taktes geladen, an der
+ * Taktgrenze selbst bleibt nur das Umschalten.
+ *
+ * Die Kette liegt im EEPROM und wird von song_init in den RAM geladen.
+ */
+
+#ifndef SONG_H_
+#define SONG_H_
+
+#include <stdint.h>
+
+#include "pattern.h"
+
+/**
+ * Anzahl der Einträge eines Songs
+ */
+#define SONG_N_ENTRIES 8
+
+/**
+ * Pattern eines Eintrags, der den Song beendet
+ */
+#define SONG_END PATTERN_NONE
+
+/**
+ * Ein Eintrag des Songs
+ */
+typedef struct {
+	/// Pattern oder SONG_END
+	uint8_t pattern;
+
+	/// Anzahl der Takte, die das Pattern gespielt wird (mindestens 1)
+	uint8_t repeats;
+} song_entry_t;
+
+/**
+ * Den Song aus dem EEPROM laden
+ *
+ * Ungültige Einträge (z.B. bei einem leeren EEPROM) beenden den Song. Das
+ * Pattern des ersten Eintrags wird geladen. Muss nach pattern_init
+ * aufgerufen werden.
+ */
+void song_init(void);
+
+/**
+ * Gibt 1 zurück, wenn ein Song gespielt wird
+ */
+uint8_t song_active(void);
+
+/**
+ * Einen Step melden
+ *
+ * Wird aus dem Clock-Event-Handler nach pattern_step aufgerufen. Schaltet an
+ * Step 0 auf den nächsten Takt weiter und merkt an der letzten Grenze des
+ * Quantums vor dem Taktende das Pattern des nächsten Taktes vor, nach einem
+ * noch nicht ausgeführten Sprung erst an einem späteren Step.
+ */
+void song_step(uint8_t step);
+
+/**
+ * Auf einen Takt des Songs springen
+ *
+ * bar zählt die Takte ab dem Anfang des Songs, bei einem kürzeren Song wird
+ * von vorn weitergezählt. step ist der Step, der als nächstes gespielt wird.
+ * Das Pattern des Taktes wird mit pattern_jump im Hintergrund geladen und
+ * spielt ab dem ersten Step, an dem es bereitliegt, gewartet wird nie. Wird
+ * bei Start, Song Position Pointer und dem Verlust der Clock aufgerufen.
+ */
+void song_locate(uint16_t bar, uint8_t step);
+
+/**
+ * Der Eintrag, der gerade gespielt wird
+ */
+uint8_t song_position(void);
+
+/**
+ * Pattern (oder SONG_END) und Wiederholungen eines Eintrags setzen
+ *
+ * Wird nur im RAM geändert, bis song_save aufgerufen wird. Ungültige Patterns
+ * beenden den Song, 0 Wiederholungen zählen als eine.
+ */
+void song_set_entry(uint8_t index, uint8_t pattern, uint8_t repeats);
+
+/**
+ * Pattern eines Eintrags oder SONG_END
+ */
+uint8_t song_get_pattern(uint8_t index);
+
+/**
+ * Wiederholungen eines Eintrags
+ */
+uint8_t song_get_repeats(uint8_t index);
+
+/**
+ * Den Song im Hintergrund im EEPROM sichern
+ *
+ * Ist die Warteschlange voll, wird der Auftrag von song_poll wiederholt.
+ */
+void song_save(void);
+
+/**
+ * Eine wegen einer vollen Warteschlange zurückgestellte Sicherung des Songs
+ * wiederholen
+ *
+ * Wird aus der Hauptschleife aufgerufen.
+ */
+void song_poll(void);
+
+#endif /* SONG_H_ */
@@ -0,0 +1,74 @@
+/**
+ * @file
+ * Systemzeit auf Basis von Timer1
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+
+#include "bits.h"
+#include "timer.h"
+
+/**
+ * Millisekundenzähler, wird vom Systemtick weitergezählt
+ */
+volatile uint8_t timer_ms = 0;
+
+/*
+ * Timer1 initialisieren und starten
+ */
+void timer_init(void)
+{
+	// Normal-Modus, der Zähler läuft frei von 0 bis 0xFFFF
+	TCCR1A = 0;
+
+	// Vorteiler 8 (siehe TIMER_PRESCALE)
+	TCCR1B = BIT(CS11);
+
+	// Zähler nullen
+	TCNT1 = 0;
+
+	// Systemtick über Compare-Match B, eine Millisekunde nach dem Start
+	OCR1B = TIMER_TICKS_PER_MS;
+	TIFR = BIT(OCF1B);
+	SETBIT(TIMSK, OCIE1B);
+}
+
+/*
+ * Aktuellen Zählerstand von Timer1 lesen
+ */
+uint16_t timer_now(void)
+{
+	uint16_t now;
+
+	// 16-Bit-Register werden über ein gemeinsames Temp-Register gelesen, ein
+	// Interrupt dazwischen könnte den Wert verfälschen
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		now = TCNT1;
+	}
+
+	return now;
+}
+
+/*
+ * Anzahl der seit dem Start vergangenen Systemticks
+ */
+uint8_t timer_millis(void)
+{
+	// 8-Bit-Zugriffe sind atomar
+	return timer_ms;
+}
+
+/**
+ * Compare-Match-Interrupt B von Timer1: der Systemtick
+ */
+ISR(TIMER1_COMPB_vect)
+{
+	// Der nächste Tick folgt genau eine Millisekunde nach dem Sollzeitpunkt
+	// dieses Ticks, eine verspätete Bearbeitung verschiebt das Raster nicht
+	OCR1B += TIMER_TICKS_PER_MS;
+
+	timer_ms++;
+}
@@ -0,0 +1,53 @@
+/**
+ * @file
+ * Systemzeit auf Basis von Timer1, externes Interface
+ *
+ * Timer1 läuft frei mit F_CPU/8 durch und dient als gemeinsame Zeitbasis für
+ * Zeitstempel, z.B. von empfangenen Midi-Nachrichten. Bei 4 MHz entspricht ein
+ * Timer-Tick 2µs, der 16-Bit-Zähler läuft nach gut 131ms über. Zeitdifferenzen
+ * werden daher immer als vorzeichenlose 16-Bit-Differenz gebildet und sind bis
+ * zu dieser Dauer gültig.
+ *
+ * Zusätzlich erzeugt der Compare-Match-Interrupt B von Timer1 einen
+ * Systemtick im Millisekunden-Abstand, der einen 8-Bit-Millisekundenzähler
+ * weiterzählt. Auf ihm bauen Zeitgeber auf, die vom Hauptprogramm bedient
+ * werden, z.B. das Abschalten getriggerter Noten.
+ */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+
+/**
+ * Vorteiler von Timer1
+ */
+#define TIMER_PRESCALE 8UL
+
+/**
+ * Anzahl der Timer-Ticks pro Millisekunde
+ */
+#define TIMER_TICKS_PER_MS (F_CPU / TIMER_PRESCALE / 1000UL)
+
+/**
+ * Timer1 initialisieren und starten
+ */
+void timer_init(void);
+
+/**
+ * Aktuellen Zählerstand von Timer1 lesen
+ *
+ * Darf sowohl aus dem Hauptprogramm als auch aus Interrupts heraus
+ * aufgerufen werden.
+ */
+uint16_t timer_now(void);
+
+/**
+ * Anzahl der seit dem Start vergangenen Systemticks (Millisekunden)
+ *
+ * Der Zähler läuft nach 256ms über, Zeitdifferenzen werden daher als
+ * vorzeichenlose 8-Bit-Differenz gebildet.
+ */
+uint8_t timer_millis(void);
+
+#endif /* TIMER_H_ */
@@ -0,0 +1,229 @@
+/**
+ * @file
+ * Spuren mit eigener Länge und eigenem Tempo
+ */
+
+#include <stdint.h>
+
+#include "bits.h"
+#include "io_config.h"
+#include "pattern.h"
+#include "track.h"
+
+/**
+ * Zustand einer Spur
+ */
+typedef struct {
+	/// Länge in Steps
+	uint8_t length;
+
+	/// Ticks pro Step, abgerundet
+	uint8_t ticks;
+
+	/// Rest der Division beim Berechnen von ticks
+	uint8_t rest;
+
+	/// Gesammelte Reste, kleiner als der Multiplikator
+	uint8_t error;
+
+	/// Ticks bis zum nächsten Step
+	uint8_t countdown;
+
+	/// Nächster zu spielender Step
+	uint8_t position;
+
+	/// Multiplikator (obere 4 Bit) und Teiler (untere 4 Bit) des Tempos
+	uint8_t rate;
+} track_t;
+
+/**
+ * Die Spuren, eine pro Instrument
+ */
+track_t tracks[N_INSTRUMENTS] = {
+	[0 ... N_INSTRUMENTS - 1] = {
+		.length = N_STEPS,
+		.ticks = TRACK_TICKS_PER_STEP,
+		.rest = 0,
+		.error = 0,
+		.countdown = 1,
+		.position = 0,
+		.rate = 0x11
+	}
+};
+
+/*
+ * Einen Tick weiterzählen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t track_tick(uint8_t *velocity)
+{
+	uint8_t mask = 0;
+
+	for(uint8_t instrument = 0; instrument < N_INSTRUMENTS; instrument++)
+	{
+		track_t *track = &tracks[instrument];
+
+		if(--track->countdown)
+			continue;
+
+		track->countdown = track->ticks;
+
+		// Die abgerundeten Bruchteile eines Ticks sammeln und bei einem ganzen
+		// Tick den Step verlängern, damit die Spur nicht gegen den Takt driftet
+		track->error += track->rest;
+		if(track->error >= (track->rate >> 4))
+		{
+			track->error -= track->rate >> 4;
+			track->countdown++;
+		}
+
+		uint8_t v = pattern_trigger(instrument, track->position);
+		if(v)
+		{
+			SETBIT(mask, instrument);
+			velocity[instrument] = v;
+		}
+
+		if(++track->position == track->length)
+			track->position = 0;
+	}
+
+	return mask;
+}
+
+/*
+ * Alle Spuren auf eine Position setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void track_locate(uint32_t ticks)
+{
+	for(uint8_t instrument = 0; instrument < N_INSTRUMENTS; instrument++)
+	{
+		track_t *track = &tracks[instrument];
+		uint8_t multiplier = track->rate >> 4;
+		uint8_t period = TRACK_TICKS_PER_STEP * (track->rate & 0x0F);
+
+		// Step k beginnt beim Tick k * period / multiplier (abgerundet), der
+		// nächste Step ist der erste, der nicht vor ticks beginnt. Springen ist
+		// selten, hier darf dividiert werden.
+		uint32_t steps = (ticks * multiplier + period - 1) / period;
+		uint32_t start = steps * period / multiplier;
+
+		track->countdown = start - ticks + 1;
+		track->error = steps * period % multiplier;
+		track->position = steps % track->length;
+	}
+}
+
+/*
+ * Den nächstgelegenen Step einer Spur bestimmen
+ * siehe Header-Datie für mehr Informationen
+ */
+uint8_t track_quantize(uint8_t instrument, uint8_t late)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	track_t *track = &tracks[instrument];
+
+	// Länge des laufenden Steps, ein übertragener Rest hat ihn um einen Tick
+	// verlängert, wenn der gesammelte Rest danach kleiner als rest ist
+	uint8_t length = track->ticks + (track->error < track->rest);
+
+	// In halben Ticks: ist der nächste Step weiter entfernt als die halbe
+	// Länge des Steps, gehört die Note noch zum zuletzt gespielten
+	if(length + late < 2 * (uint16_t)track->countdown)
+		return (track->position ? track->position : track->length) - 1;
+
+	return track->position;
+}
+
+/*
+ * Die Länge einer Spur setzen
+ */
+void track_set_length(uint8_t instrument, uint8_t length)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return;
+
+	if(length < 1)
+		length = 1;
+	else if(length > N_STEPS)
+		length = N_STEPS;
+
+	track_t *track = &tracks[instrument];
+	track->length = length;
+
+	if(track->position >= length)
+		track->position = 0;
+}
+
+/*
+ * Die Länge einer Spur
+ */
+uint8_t track_get_length(uint8_t instrument)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	return tracks[instrument].length;
+}
+
+/*
+ * Das Tempo einer Spur setzen
+ * siehe Header-Datie für mehr Informationen
+ */
+void track_set_rate(uint8_t instrument, uint8_t multiplier, uint8_t divider)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return;
+
+	if(multiplier < 1)
+		multiplier = 1;
+	else if(multiplier > TRACK_RATE_MAX)
+		multiplier = TRACK_RATE_MAX;
+
+	if(divider < 1)
+		divider = 1;
+	else if(divider > TRACK_RATE_MAX)
+		divider = TRACK_RATE_MAX;
+
+	track_t *track = &tracks[instrument];
+	track->ticks = (uint16_t)TRACK_TICKS_PER_STEP * divider / multiplier;
+	track->rest = (uint16_t)TRACK_TICKS_PER_STEP * divider % multiplier;
+	track->error = 0;
+	track->rate = (multiplier << 4) | divider;
+}
+
+/*
+ * Der Multiplikator des Tempos einer Spur
+ */
+uint8_t track_get_multiplier(uint8_t instrument)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	return tracks[instrument].rate >> 4;
+}
+
+/*
+ * Der Teiler des Tempos einer Spur
+ */
+uint8_t track_get_divider(uint8_t instrument)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	return tracks[instrument].rate & 0x0F;
+}
+
+/*
+ * Der nächste Step einer Spur
+ */
+uint8_t track_position(uint8_t instrument)
+{
+	if(instrument >= N_INSTRUMENTS)
+		return 0;
+
+	return tracks[instrument].position;
+}
@@ -0,0 +1,103 @@
+/**
+ * @file
+ * Spuren mit eigener Länge und eigenem Tempo, externes Interface
+ *
+ * Jedes Instrument spielt seine Spur im Pattern mit einer eigenen Länge (1 bis
+ * N_STEPS Steps) und einem eigenen Tempo, angegeben als Multiplikator und
+ * Teiler gegenüber einem 16tel. So entstehen Polymetrik (z.B. eine Spur mit 5
+ * neben einer mit 16 Steps) und Spuren in halbem, doppeltem oder
+ * Triolen-Tempo.
+ *
+ * Alle Spuren laufen von den Ticks des Taktgebers (96 ppqn). Jede Spur hat
+ * einen Rückwärtszähler der Ticks bis zu ihrem nächsten Step und einen
+ * Step-Zähler, beide werden nur heruntergezählt bzw. verglichen. Ein Tick
+ * kostet so pro Spur eine Subtraktion, Divisionen gibt es nur beim Einstellen
+ * und beim Springen per Song Position Pointer.
+ *
+ * Nach dem Einschalten laufen alle Spuren mit N_STEPS Steps im 16tel-Tempo,
+ * also genau wie ohne eigene Einstellungen. Die Einstellungen liegen nur im
+ * RAM.
+ */
+
+#ifndef TRACK_H_
+#define TRACK_H_
+
+#include <stdint.h>
+
+#include "clock.h"
+
+/**
+ * Ticks pro 16tel, dem Step einer Spur mit Multiplikator und Teiler 1
+ */
+#define TRACK_TICKS_PER_STEP (6 * CLOCK_TICKS_PER_CLOCK)
+
+/**
+ * Größter Multiplikator bzw. Teiler des Tempos einer Spur
+ */
+#define TRACK_RATE_MAX 8
+
+/**
+ * Die Spuren zählen einen Tick weiter
+ *
+ * Wird von midi_dispatch bei jedem Tick nach dem Clock-Event-Handler
+ * aufgerufen. Gibt die zu triggernden Instrumente zurück, ein Bit pro
+ * Instrument, und schreibt deren Anschlagstärken nach velocity.
+ */
+uint8_t track_tick(uint8_t *velocity);
+
+/**
+ * Alle Spuren auf eine Position setzen
+ *
+ * ticks zählt die Ticks ab dem Anfang des Songs bis zum nächsten Tick. Wird bei
+ * Start (0) und Song Position Pointer aufgerufen.
+ */
+void track_locate(uint32_t ticks);
+
+/**
+ * Den Step einer Spur bestimmen, der einer gerade empfangenen Note am
+ * nächsten liegt
+ *
+ * late ist 1, wenn die Note in der zweiten Hälfte des letzten Ticks empfangen
+ * wurde. Wird beim Aufnehmen aufgerufen, damit eine Note auf dem Step der
+ * Spur landet, der an dieser Stelle gespielt wird.
+ */
+uint8_t track_quantize(uint8_t instrument, uint8_t late);
+
+/**
+ * Die Länge einer Spur in Steps setzen (1 bis N_STEPS)
+ */
+void track_set_length(uint8_t instrument, uint8_t length);
+
+/**
+ * Die Länge einer Spur in Steps
+ */
+uint8_t track_get_length(uint8_t instrument);
+
+/**
+ * Das Tempo einer Spur setzen
+ *
+ * Ein Step dauert ein 16tel mal divider durch multiplier, jeweils 1 bis
+ * TRACK_RATE_MAX, z.B. liefert der Multiplikator 3 16tel-Triolen. Ergibt sich
+ * keine ganze Zahl von Ticks (Multiplikator 5 oder 7), werden die Steps
+ * abwechselnd einen Tick länger, so dass die Spur im Mittel genau im Tempo
+ * bleibt und nicht gegen den Takt driftet. Wirksam ab dem nächsten Step der
+ * Spur.
+ */
+void track_set_rate(uint8_t instrument, uint8_t multiplier, uint8_t divider);
+
+/**
+ * Der Multiplikator des Tempos einer Spur
+ */
+uint8_t track_get_multiplier(uint8_t instrument);
+
+/**
+ * Der Teiler des Tempos einer Spur
+ */
+uint8_t track_get_divider(uint8_t instrument);
+
+/**
+ * Der Step, den eine Spur als nächstes spielt
+ */
+uint8_t track_position(uint8_t instrument);
+
+#endif /* TRACK_H_ */